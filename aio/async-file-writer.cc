@@ -1,25 +1,226 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
 #include "async-file-writer.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+// The largest interval adaptive queue processing backs off to.
+#define MAX_QUEUE_PROCESSING_INTERVAL   4096
+
+// The size of the staging blocks reserve() hands out, and the number of
+// written blocks kept for reuse.
+#define STAGING_BLOCK_SZ                (64 * 1024)
+#define STAGING_FREE_BLOCKS             16
+
+// The alignment of the buffer of buffered synchronous mode, enough for
+// O_DIRECT on any common device.
+#define SYNC_BUFFER_ALIGNMENT           4096
+
+// The largest write adaptive dispatch writes directly, the weight of a new
+// latency sample in its running averages, and how often it takes the path
+// it currently loses on to measure it again.
+#define ADAPTIVE_DISPATCH_MAX_SZ        (64 * 1024)
+#define ADAPTIVE_DISPATCH_WEIGHT        0.125
+#define ADAPTIVE_DISPATCH_PROBE         64
+
+// The file operation types.
+#define FILE_OPERATION_CLOSE            0
+#define FILE_OPERATION_SYNC             1
+#define FILE_OPERATION_UNLINK           2
+#define FILE_OPERATION_RENAME           3
+#define FILE_OPERATION_TRUNCATE         4
+
+// Write all of count bytes at offset, resuming after short writes and
+// interrupted calls. Returns the bytes written, which is less than count only
+// if an error stopped it, or -1 if nothing was written.
+static ssize_t pwriteAll(int fd, const void *data, size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t wbytes = pwrite(fd, (const unsigned char *)data + done,
+                                count - done, offset + done);
+
+        if (wbytes == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (wbytes <= 0) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+
+        done += wbytes;
+    }
+
+    return done;
+}
+
+// The most buffers one pwritev() call takes.
+#ifndef IOV_MAX
+#define IOV_MAX                         1024
+#endif
+
+// Write all of the count bytes of an iovec array at offset, like pwriteAll().
+static ssize_t pwritevAll(int fd, const struct iovec *iov, int iovcnt,
+                          size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t wbytes = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+                                 offset + done);
+
+        if (wbytes == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (wbytes <= 0) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+
+        done += wbytes;
+
+        // Skip the buffers written in full and finish one written in part on
+        // its own, so the array is never modified.
+        while (iovcnt > 0 && (size_t)wbytes >= iov->iov_len) {
+            wbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (wbytes > 0) {
+            size_t rest = iov->iov_len - wbytes;
+            ssize_t more = pwriteAll(fd, (const unsigned char *)iov->iov_base +
+                                     wbytes, rest, offset + done);
+
+            if (more > 0) {
+                done += more;
+            }
+
+            if (more != (ssize_t)rest) {
+                return done;
+            }
+
+            iov++;
+            iovcnt--;
+        }
+    }
+
+    return done;
+}
+
+// Write the data of an iovec array at offset with pwrite() or pwritev(),
+// between the syscall tracepoints.
+static ssize_t pwriteData(int fd, const struct iovec *iov, int iovcnt,
+                          size_t count, off_t offset)
+{
+    ssize_t wbytes;
+
+    TRACE(TRACE_SYSCALL_START, offset, count);
+
+    if (iovcnt == 1) {
+        wbytes = pwriteAll(fd, iov[0].iov_base, count, offset);
+    } else {
+        wbytes = pwritevAll(fd, iov, iovcnt, count, offset);
+    }
+
+    TRACE(TRACE_SYSCALL_END, offset, wbytes);
+    return wbytes;
+}
+
+static double monotonicTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copy the buffers of an iovec array one after the other to dest.
+static void gather(unsigned char *dest, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+}
 
 AsyncFileWriter::AsyncFileWriter(const char *filename)
 {
     queueProcessingInterval = 40;
+    adaptiveProcessing = false;
+    memoryBudget = 16 * 1024 * 1024;
+    latencyBudget = 0;
+    queuedBytes = 0;
+    sinceProcessed = 0;
+    bytesSinceProcessed = 0;
+    lastProcessed = 0;
+    notifier = NULL;
     listHead = NULL;
     lastBuffer = NULL;
     fd = -1;
     this->filename = filename;
     openFlags = O_WRONLY|O_CREAT|O_TRUNC;
     openMode = S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
+    bufferArena = NULL;
     offset = 0;
-    submitted = 0;
-    completed = 0;
+    trailingHole = false;
+    positionalEnd = 0;
+    canceledFrom = -1;
+    stagingBlock = NULL;
+    stagingUsed = 0;
+    stagingSize = 0;
+    stagingFree = NULL;
+    stagingFreeCount = 0;
+    writePriority = WRITE_PRIORITY_NORMAL;
+    ioPriorityClass = 0;
+    ioPriorityLevel = 0;
+    cpuAffinitySet = false;
+    schedulingPolicy = SCHED_OTHER;
+    schedulingPriority = 0;
+    schedulingSet = false;
+    numaNode = -1;
+    numaAffinitySet = false;
+    submitted = WRITE_COUNT_START;
+    completed = WRITE_COUNT_START;
+    adaptiveDispatch = false;
+    directLatency = 0;
+    queuedLatency = 0;
+    dispatchProbe = 0;
+    sampleProbe = 0;
     synchronous = false;
+    syncBuffer = NULL;
+    syncBufferSize = 0;
+    syncBufferUsed = 0;
+    syncBufferOffset = 0;
     closeCalled = false;
+    writeError = false;
     opened = false;
+    openStarted = false;
+    operationHead = NULL;
+    operationTail = NULL;
+    operationsRunning = false;
     initError = false;
 
     if (pthread_mutex_init(&openedLock, NULL) != 0) {
         initError = true;
     }
+
+    if (pthread_cond_init(&openedCond, NULL) != 0) {
+        initError = true;
+    }
+
+    // Bulk writes are issued at the lowest priority AIO allows. Requests for
+    // the same file are run in priority order, so normal writes overtake
+    // any bulk writes still waiting.
+    long delta = sysconf(_SC_AIO_PRIO_DELTA_MAX);
+    bulkRequestPriority = delta > 0 ? (int)delta : 0;
 }
 
 AsyncFileWriter::~AsyncFileWriter()
@@ -30,20 +231,347 @@ AsyncFileWriter::~AsyncFileWriter()
     // completed, cancelWrites() doesn't do anything. We call it just to be
     // sure all memory allocated has really been freed to avoid memory leaks.
     cancelWrites();
-    closeFile();
+
+    // A buffer that cannot be written out is discarded so the file is still
+    // closed.
+    if (closeFile() == -1 && !closeCalled) {
+        syncBufferUsed = 0;
+        closeFile();
+    }
+
+    free(syncBuffer);
+
+    // Free the staging blocks. Any data committed but not flushed is lost.
+    if (stagingBlock != NULL) {
+        releaseStagingBlock(stagingBlock, stagingSize);
+    }
+
+    while (stagingFree != NULL) {
+        void *block = stagingFree;
+
+        stagingFree = *(void **)block;
+
+        if (bufferArena != NULL) {
+            bufferArena->release(block, STAGING_BLOCK_SZ);
+        } else {
+            free(block);
+        }
+    }
 
     // Clean up the open thread attributes. The attributes will have been set
-    // only if an attempt to open the file happened.
+    // only if an attempt to open the file happened. The operation thread uses
+    // this object, so wait for it as well.
     pthread_mutex_lock(&openedLock);
 
+    while (operationsRunning) {
+        pthread_cond_wait(&openedCond, &openedLock);
+    }
+
     if (opened) {
         pthread_attr_destroy(&attr);
     }
 
     pthread_mutex_unlock(&openedLock);
 
-    // Clean up the mutex.
+    // Clean up the mutex and condition variable.
     pthread_mutex_destroy(&openedLock);
+    pthread_cond_destroy(&openedCond);
+
+    // Drop the writer's reference to the completion fd. It is closed once
+    // no notification can use it any more.
+    if (notifier != NULL) {
+        releaseNotifier(notifier);
+    }
+}
+
+// Free a buffer and its data if the data was copied by the writer.
+void AsyncFileWriter::freeBuffer(aioBuffer *buffer)
+{
+    // A resubmitted aiocb only covers the end of the data.
+    void *data = (unsigned char *)buffer->aiocb.aio_buf - buffer->resubmitted;
+
+    if (buffer->sample != NULL) {
+        releaseSample(buffer->sample);
+    }
+
+    if (buffer->stagingSize > 0) {
+        releaseStagingBlock(data, buffer->stagingSize);
+    } else if (buffer->ownsData) {
+        if (bufferArena != NULL) {
+            bufferArena->release(data, buffer->aiocb.aio_nbytes +
+                                       buffer->resubmitted);
+        } else {
+            free(data);
+        }
+    }
+
+    free(buffer);
+}
+
+// Get a staging block of size bytes, reusing a written one if it is the
+// standard size.
+void *AsyncFileWriter::allocateStagingBlock(size_t size)
+{
+    if (size == STAGING_BLOCK_SZ && stagingFree != NULL) {
+        void *block = stagingFree;
+
+        stagingFree = *(void **)block;
+        stagingFreeCount--;
+        return block;
+    }
+
+    if (bufferArena != NULL) {
+        return bufferArena->allocate(size);
+    }
+
+    return malloc(size);
+}
+
+// Keep a written staging block for reuse, or free it if it is larger than
+// the standard size or enough blocks are kept already.
+void AsyncFileWriter::releaseStagingBlock(void *block, size_t size)
+{
+    if (size == STAGING_BLOCK_SZ && stagingFreeCount < STAGING_FREE_BLOCKS) {
+        *(void **)block = stagingFree;
+        stagingFree = block;
+        stagingFreeCount++;
+        return;
+    }
+
+    if (bufferArena != NULL) {
+        bufferArena->release(block, size);
+    } else {
+        free(block);
+    }
+}
+
+// Run the completion callbacks for a list of finished buffers and free them.
+// The callbacks are run in submission order once the queue scan is done, so
+// a callback can safely submit more writes.
+void AsyncFileWriter::completeBuffers(aioBuffer *done)
+{
+    aioBuffer *removal;
+
+    while (done != NULL) {
+        removal = done;
+        done = done->next;
+        queuedBytes -= removal->aiocb.aio_nbytes + removal->resubmitted;
+
+        if (removal->callback != NULL) {
+            int status = 0;
+            size_t written = removal->resubmitted;
+
+            if (removal->written != (ssize_t)removal->aiocb.aio_nbytes) {
+                status = -1;
+            }
+
+            if (removal->written > 0) {
+                written += removal->written;
+            }
+
+            removal->callback(removal->callbackContext, status, written);
+        }
+
+        freeBuffer(removal);
+    }
+}
+
+// Call aio_write() for a buffer, between the tracepoints of the call.
+int AsyncFileWriter::issueBuffer(aioBuffer *buffer)
+{
+    TRACE(TRACE_SYSCALL_START, buffer->aiocb.aio_offset,
+          buffer->aiocb.aio_nbytes);
+    int ret = aio_write(&buffer->aiocb);
+    TRACE(TRACE_SYSCALL_END, buffer->aiocb.aio_offset,
+          ret == 0 ? (int64_t)buffer->aiocb.aio_nbytes : -1);
+    return ret;
+}
+
+// Issue the AIO write request for a buffer. If there is a completion fd, the
+// request signals it through a notification thread when it completes. The
+// notification of a write measured for adaptive dispatch also takes the time
+// it completed.
+int AsyncFileWriter::enqueueBuffer(aioBuffer *buffer)
+{
+    if (buffer->sample != NULL) {
+        dispatchSample *sample = buffer->sample;
+
+        buffer->aiocb.aio_sigevent.sigev_notify = SIGEV_THREAD;
+        buffer->aiocb.aio_sigevent.sigev_notify_function =
+            &AsyncFileWriter::notifySample;
+        buffer->aiocb.aio_sigevent.sigev_notify_attributes = NULL;
+        buffer->aiocb.aio_sigevent.sigev_value.sival_ptr = sample;
+        // The notification holds a reference to the sample, and one to the
+        // completion fd it signals.
+        pthread_mutex_lock(&sample->sampleLock);
+        sample->references++;
+        sample->notifier = notifier;
+        pthread_mutex_unlock(&sample->sampleLock);
+
+        if (notifier != NULL) {
+            pthread_mutex_lock(&notifier->notifierLock);
+            notifier->references++;
+            pthread_mutex_unlock(&notifier->notifierLock);
+        }
+
+        if (issueBuffer(buffer) == -1) {
+            int saved_errno = errno;
+
+            if (notifier != NULL) {
+                releaseNotifier(notifier);
+            }
+
+            releaseSample(sample);
+            errno = saved_errno;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (notifier == NULL) {
+        buffer->aiocb.aio_sigevent.sigev_notify = SIGEV_NONE;
+        return issueBuffer(buffer);
+    }
+
+    buffer->aiocb.aio_sigevent.sigev_notify = SIGEV_THREAD;
+    buffer->aiocb.aio_sigevent.sigev_notify_function =
+        &AsyncFileWriter::notifyCompletion;
+    buffer->aiocb.aio_sigevent.sigev_notify_attributes = NULL;
+    buffer->aiocb.aio_sigevent.sigev_value.sival_ptr = notifier;
+    // Each request in flight holds a reference, released by its
+    // notification.
+    pthread_mutex_lock(&notifier->notifierLock);
+    notifier->references++;
+    pthread_mutex_unlock(&notifier->notifierLock);
+
+    if (issueBuffer(buffer) == -1) {
+        int saved_errno = errno;
+
+        releaseNotifier(notifier);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// The AIO notification function. It runs on a thread of its own when a
+// request completes and signals the completion fd.
+void AsyncFileWriter::notifyCompletion(union sigval value)
+{
+    completionNotifier *completion = (completionNotifier *)value.sival_ptr;
+
+    signalNotifier(completion);
+    releaseNotifier(completion);
+}
+
+// Make the completion fd readable.
+void AsyncFileWriter::signalNotifier(completionNotifier *completion)
+{
+    if (completion->readFd == completion->writeFd) {
+        uint64_t one = 1;
+
+        if (::write(completion->writeFd, &one, sizeof(one)) == -1) {
+            // The counter is already readable, there is nothing to add.
+        }
+    } else {
+        char one = 1;
+
+        if (::write(completion->writeFd, &one, sizeof(one)) == -1) {
+            // The pipe is full, so it is already readable.
+        }
+    }
+}
+
+// Drop a reference to the completion fd and close it with the last one.
+void AsyncFileWriter::releaseNotifier(completionNotifier *completion)
+{
+    pthread_mutex_lock(&completion->notifierLock);
+    int references = --completion->references;
+    pthread_mutex_unlock(&completion->notifierLock);
+
+    if (references == 0) {
+        if (completion->writeFd != completion->readFd) {
+            close(completion->writeFd);
+        }
+
+        close(completion->readFd);
+        pthread_mutex_destroy(&completion->notifierLock);
+        free(completion);
+    }
+}
+
+// The AIO notification function of a write measured for adaptive dispatch.
+// It records when the write completed and signals the completion fd, if
+// there is one.
+void AsyncFileWriter::notifySample(union sigval value)
+{
+    dispatchSample *sample = (dispatchSample *)value.sival_ptr;
+    double complete_time = monotonicTime();
+    completionNotifier *completion;
+
+    pthread_mutex_lock(&sample->sampleLock);
+    sample->completeTime = complete_time;
+    completion = sample->notifier;
+    pthread_mutex_unlock(&sample->sampleLock);
+
+    if (completion != NULL) {
+        signalNotifier(completion);
+        releaseNotifier(completion);
+    }
+
+    releaseSample(sample);
+}
+
+// Drop a reference to a sample and free it with the last one.
+void AsyncFileWriter::releaseSample(dispatchSample *sample)
+{
+    pthread_mutex_lock(&sample->sampleLock);
+    int references = --sample->references;
+    pthread_mutex_unlock(&sample->sampleLock);
+
+    if (references == 0) {
+        pthread_mutex_destroy(&sample->sampleLock);
+        free(sample);
+    }
+}
+
+// Set the CPU affinity of a thread about to be created, so it never starts
+// on a CPU it is not allowed to run on.
+int AsyncFileWriter::initThreadAttributes(pthread_attr_t *thread_attr)
+{
+#ifdef __linux__
+    if (cpuAffinitySet) {
+        return pthread_attr_setaffinity_np(thread_attr, sizeof(cpu_set_t),
+                                           &cpuAffinity);
+    }
+
+    if (numaAffinitySet) {
+        return pthread_attr_setaffinity_np(thread_attr, sizeof(cpu_set_t),
+                                           &numaAffinity);
+    }
+#endif
+
+    return 0;
+}
+
+// Apply the scheduling and I/O priority settings to the calling thread. This
+// runs at the start of the thread instead of through its attributes, so a
+// policy the process has no privilege for leaves the thread at the default
+// instead of failing to create it.
+void AsyncFileWriter::configureThread()
+{
+    if (schedulingSet) {
+        struct sched_param param;
+
+        param.sched_priority = schedulingPriority;
+        pthread_setschedparam(pthread_self(), schedulingPolicy, &param);
+    }
+
+    if (ioPriorityClass != 0) {
+        setThreadIOPriority(ioPriorityClass, ioPriorityLevel);
+    }
 }
 
 // This is the private open thread helper method. This recieves a pointer
@@ -57,13 +585,19 @@ void *AsyncFileWriter::thr_open_helper(void *context) {
 // The actual private thread open method.
 void AsyncFileWriter::thr_open()
 {
+    configureThread();
+    traceThreadName("open");
+
     pthread_mutex_lock(&openedLock);
 
     if (!opened) {
         // We don't need to check the result of open. If fd is -1 and opened
         // is true, we know there was a problem.
+        TRACE(TRACE_OPEN_START, 0, 0);
         fd = open(filename, openFlags, openMode);
+        TRACE(TRACE_OPEN_END, 0, fd);
         opened = true;
+        pthread_cond_broadcast(&openedCond);
     }
 
     pthread_mutex_unlock(&openedLock);
@@ -72,7 +606,9 @@ void AsyncFileWriter::thr_open()
 int AsyncFileWriter::openFile()
 {
     if (synchronous) {
+        TRACE(TRACE_OPEN_START, 0, 0);
         fd = open(filename, openFlags, openMode);
+        TRACE(TRACE_OPEN_END, 0, fd);
         return fd;
     }
 
@@ -102,11 +638,16 @@ int AsyncFileWriter::openFile()
             return -1;
         }
 
+        if (initThreadAttributes(&attr) != 0) {
+            return -1;
+        }
+
         if (pthread_create(&ntid, &attr, &AsyncFileWriter::thr_open_helper,
                            this) != 0) {
             return -1;
         }
 
+        openStarted = true;
         return 0;
     }
 
@@ -114,9 +655,13 @@ int AsyncFileWriter::openFile()
     return fd;
 }
 
+// Close the file once its writes have completed. Returns -1 without closing
+// it if the buffer of buffered synchronous mode cannot be written out.
 int AsyncFileWriter::closeFile()
 {
     int ret = 0;
+    int close_fd;
+    bool open_failed;
 
     // We should only close the file once. This is used in the destructor, so
     // if the user closed the file explicitly, there is nothing to do.
@@ -124,92 +669,912 @@ int AsyncFileWriter::closeFile()
         return ret;
     }
 
-    if (synchronous) {
-        if (fd != -1) {
-            ret = close(fd);
-        }
-
-        closeCalled = true;
-        return ret;
+    // Buffered synchronous writes go out before the close. If they cannot,
+    // the file stays open with the data still buffered, so the caller can
+    // retry the close.
+    if (flushSyncBuffer() == -1) {
+        return -1;
     }
 
+    closeCalled = true;
     pthread_mutex_lock(&openedLock);
 
-    if (opened) {
-        if (fd == -1) {
-            // There was an open() error.
+    // Wait for an open or file operations still running in the background,
+    // so the fd is not closed under them.
+    while ((openStarted && !opened) || operationsRunning) {
+        pthread_cond_wait(&openedCond, &openedLock);
+    }
+
+    close_fd = fd;
+    open_failed = opened && fd == -1;
+    fd = -1;
+    pthread_mutex_unlock(&openedLock);
+
+    // The lock is not held across close(), which can block for a long time
+    // on a network file system.
+    if (open_failed) {
+        // There was an open() error.
+        return -1;
+    }
+
+    if (close_fd != -1) {
+        // All writes have completed by now, so extending the file to the
+        // current offset only fills in the trailing hole.
+        if (trailingHole && offset > positionalEnd &&
+            ftruncate(close_fd, offset) == -1) {
+            ret = -1;
+        }
+
+        if (close(close_fd) == -1) {
             ret = -1;
-        } else {
-            ret = close(fd);
         }
     }
 
-    pthread_mutex_unlock(&openedLock);
-    closeCalled = true;
     return ret;
 }
 
-int AsyncFileWriter::getSubmitted()
+// Flush the file to stable storage with fsync(). Only writes that have
+// completed are covered, so call this once pendingWrites() is false. It waits
+// for an open still running in the background.
+int AsyncFileWriter::syncFile()
 {
-    return submitted;
-}
+    int sync_fd;
 
-int AsyncFileWriter::getCompleted()
-{
-    return completed;
-}
+    pthread_mutex_lock(&openedLock);
 
-bool AsyncFileWriter::pendingWrites()
-{
-    return submitted != completed;
-}
+    while (openStarted && !opened) {
+        pthread_cond_wait(&openedCond, &openedLock);
+    }
 
-bool AsyncFileWriter::getSynchronous()
-{
-    return synchronous;
-}
+    sync_fd = fd;
+    pthread_mutex_unlock(&openedLock);
 
-void AsyncFileWriter::setSynchronous(bool value)
-{
-    synchronous = value;
-}
+    if (sync_fd == -1 || closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
 
-int AsyncFileWriter::getQueueProcessingInterval()
-{
-    return queueProcessingInterval;
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    return fsync(sync_fd);
 }
 
-void AsyncFileWriter::setQueueProcessingInterval(int value)
-{
-    queueProcessingInterval = value;
+// This is the private operation thread helper method. This recieves a pointer
+// to this so that it can call the right object's thr_operations() method.
+void *AsyncFileWriter::thr_operations_helper(void *context) {
+    ((AsyncFileWriter *)context)->thr_operations();
+    return (void *)0;
 }
 
-int AsyncFileWriter::write(const void *data, size_t count)
+// The operation thread. It runs the queued file operations in order once the
+// open has finished and exits when the queue is empty. The lock is only held
+// to take an operation off the queue, never across the system call.
+void AsyncFileWriter::thr_operations()
 {
-    // Do a simple pwrite() if in synchronous mode.
-    if (synchronous) {
-        int wbytes;
+    configureThread();
 
-        if ((wbytes = pwrite(fd, data, count, offset)) != count) {
-            // This could be because of an error (-1 return value) or a short
-            // write. Neither of those should happen, so we just return an
-            // error.
-            return -1;
-        }
+    pthread_mutex_lock(&openedLock);
 
-        // Increment the offset for the next write and the submitted write
-        // count.
-        offset += count;
-        return wbytes;
+    while (openStarted && !opened) {
+        pthread_cond_wait(&openedCond, &openedLock);
     }
 
-    // Check if there was an init error. This only happens if the mutex
-    // initialization failed.
-    if (initError) {
-        return -1;
-    }
+    while (operationHead != NULL) {
+        fileOperation *operation = operationHead;
+        int operation_fd = fd;
+        const char *name = filename;
+        int error = 0;
 
-    int current_fd;
+        operationHead = operation->next;
+
+        if (operationHead == NULL) {
+            operationTail = NULL;
+        }
+
+        if (operation->type == FILE_OPERATION_CLOSE) {
+            fd = -1;
+        }
+
+        pthread_mutex_unlock(&openedLock);
+
+        switch (operation->type) {
+        case FILE_OPERATION_CLOSE:
+            if (operation_fd == -1) {
+                error = EBADF;
+                break;
+            }
+
+            if (operation->length != -1 &&
+                ftruncate(operation_fd, operation->length) == -1) {
+                error = errno;
+            }
+
+            if (close(operation_fd) == -1 && error == 0) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_TRUNCATE:
+            if (operation_fd == -1) {
+                error = EBADF;
+            } else if (ftruncate(operation_fd, operation->length) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_SYNC:
+            if (operation_fd == -1) {
+                error = EBADF;
+            } else if (fsync(operation_fd) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_UNLINK:
+            if (unlink(name) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_RENAME:
+            if (rename(name, operation->newName) == -1) {
+                error = errno;
+            }
+
+            break;
+        }
+
+        if (operation->callback != NULL) {
+            operation->callback(operation->callbackContext, error);
+        }
+
+        pthread_mutex_lock(&openedLock);
+
+        // Later operations use the new name.
+        if (operation->type == FILE_OPERATION_RENAME && error == 0) {
+            filename = operation->newName;
+        }
+
+        free(operation);
+    }
+
+    operationsRunning = false;
+    pthread_cond_broadcast(&openedCond);
+    pthread_mutex_unlock(&openedLock);
+}
+
+// Queue a file operation and start the operation thread if it is not running.
+int AsyncFileWriter::queueOperation(int type, off_t length,
+                                    const char *new_name, fileCallback callback,
+                                    void *context)
+{
+    fileOperation *operation;
+
+    if (initError) {
+        return -1;
+    }
+
+    if ((operation = (fileOperation *)malloc(sizeof(fileOperation))) == NULL) {
+        return -1;
+    }
+
+    operation->type = type;
+    operation->length = length;
+    operation->newName = new_name;
+    operation->callback = callback;
+    operation->callbackContext = context;
+    operation->next = NULL;
+
+    pthread_mutex_lock(&openedLock);
+
+    if (!operationsRunning) {
+        pthread_attr_t operation_attr;
+        pthread_t operation_tid;
+        int ret = -1;
+
+        // The thread is detached like the open thread. The destructor waits
+        // for it through operationsRunning instead of joining it.
+        if (pthread_attr_init(&operation_attr) == 0) {
+            if (pthread_attr_setdetachstate(&operation_attr,
+                                            PTHREAD_CREATE_DETACHED) == 0 &&
+                initThreadAttributes(&operation_attr) == 0) {
+                // The queue is empty while the thread is not running, and the
+                // lock is held, so the new thread waits for the operation.
+                ret = pthread_create(&operation_tid, &operation_attr,
+                                     &AsyncFileWriter::thr_operations_helper,
+                                     this);
+            }
+
+            pthread_attr_destroy(&operation_attr);
+        }
+
+        if (ret != 0) {
+            pthread_mutex_unlock(&openedLock);
+            free(operation);
+            return -1;
+        }
+
+        operationsRunning = true;
+    }
+
+    if (operationTail == NULL) {
+        operationHead = operation;
+    } else {
+        operationTail->next = operation;
+    }
+
+    operationTail = operation;
+    pthread_mutex_unlock(&openedLock);
+    return 0;
+}
+
+// Close the file in the background. Like closeFile(), call this once
+// pendingWrites() is false. The callback runs on the operation thread and
+// receives EBADF if the file is not open. Returns -1 if the file was already
+// closed or the close could not be queued.
+int AsyncFileWriter::closeFileAsync(fileCallback callback, void *context)
+{
+    if (closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    off_t length = trailingHole && offset > positionalEnd ? offset : -1;
+
+    if (queueOperation(FILE_OPERATION_CLOSE, length, NULL, callback,
+                       context) == -1) {
+        return -1;
+    }
+
+    closeCalled = true;
+    return 0;
+}
+
+// Flush the file to stable storage in the background. Only writes that have
+// completed by the time the fsync runs are covered.
+int AsyncFileWriter::syncFileAsync(fileCallback callback, void *context)
+{
+    if (closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    return queueOperation(FILE_OPERATION_SYNC, -1, NULL, callback, context);
+}
+
+// Remove the file in the background. The file can still be written and
+// closed afterwards.
+int AsyncFileWriter::unlinkFile(fileCallback callback, void *context)
+{
+    return queueOperation(FILE_OPERATION_UNLINK, -1, NULL, callback, context);
+}
+
+// Rename the file in the background. The writer uses the new name once the
+// rename succeeds, so the string has to stay valid as long as the writer,
+// like the one given to the constructor.
+int AsyncFileWriter::renameFile(const char *new_name, fileCallback callback,
+                                void *context)
+{
+    return queueOperation(FILE_OPERATION_RENAME, -1, new_name, callback,
+                          context);
+}
+
+int64_t AsyncFileWriter::getSubmitted()
+{
+    return submitted;
+}
+
+int64_t AsyncFileWriter::getCompleted()
+{
+    return completed;
+}
+
+// Return the number of writes, counted in the order they were submitted,
+// that have all completed. Writes can complete out of order, so this can be
+// less than getCompleted(). Memory passed to writeNoCopy() can be reused once
+// this count is past the write that used it.
+int64_t AsyncFileWriter::getCompletedPrefix()
+{
+    if (listHead == NULL) {
+        return submitted;
+    }
+
+    return listHead->sequence;
+}
+
+bool AsyncFileWriter::pendingWrites()
+{
+    // Data committed to the staging block is pending too. The next
+    // processQueue() queues it.
+    return submitted != completed || stagingUsed > 0;
+}
+
+bool AsyncFileWriter::getSynchronous()
+{
+    return synchronous;
+}
+
+void AsyncFileWriter::setSynchronous(bool value)
+{
+    synchronous = value;
+}
+
+bool AsyncFileWriter::getAdaptiveDispatch()
+{
+    return adaptiveDispatch;
+}
+
+// Choose between a direct pwrite() and the queue for each write, instead of
+// always queueing. A write of up to ADAPTIVE_DISPATCH_MAX_SZ bytes that finds
+// the queue empty is written on the caller's thread while that has had the
+// lower latency, which is when the queue costs more than the syscall. Larger
+// writes and writes behind others are always queued. Direct writes complete
+// before the call returns, like in synchronous mode.
+//
+// A queued write whose latency is measured is timed by an AIO notification,
+// which costs a thread start for that write. Only the probes of the queue and
+// one in ADAPTIVE_DISPATCH_PROBE of the other queued writes are measured.
+void AsyncFileWriter::setAdaptiveDispatch(bool value)
+{
+    adaptiveDispatch = value;
+}
+
+// Return true if a write to an empty queue should be written directly. Every
+// ADAPTIVE_DISPATCH_PROBE-th write takes the slower path instead, so its
+// average keeps up with the device and the load.
+bool AsyncFileWriter::dispatchDirect()
+{
+    bool direct = directLatency <= queuedLatency;
+
+    if (++dispatchProbe >= ADAPTIVE_DISPATCH_PROBE) {
+        dispatchProbe = 0;
+        return !direct;
+    }
+
+    return direct;
+}
+
+// Write data on the caller's thread for adaptive dispatch and time it. It
+// counts as a submitted and completed write. If it fails, nothing was
+// submitted and -1 is returned, as in synchronous mode. A staging block of
+// staging_size bytes is released once it is written, since no queued write
+// will free it.
+int AsyncFileWriter::writeDirect(int write_fd, const struct iovec *iov,
+                                 int iovcnt, size_t count, bool append,
+                                 off_t write_offset, writeCallback callback,
+                                 void *context, size_t staging_size)
+{
+    double start = monotonicTime();
+    ssize_t wbytes = pwriteData(write_fd, iov, iovcnt, count, write_offset);
+
+    directLatency += (monotonicTime() - start - directLatency) *
+                     ADAPTIVE_DISPATCH_WEIGHT;
+
+    if (wbytes != (ssize_t)count) {
+        return -1;
+    }
+
+    if (staging_size > 0) {
+        releaseStagingBlock(iov[0].iov_base, staging_size);
+    }
+
+    TRACE(TRACE_COMPLETE, write_offset, count);
+    advanceOffset(append, write_offset, count);
+    submitted += 1;
+    completed++;
+
+    if (callback != NULL) {
+        callback(context, 0, count);
+    }
+
+    return 0;
+}
+
+size_t AsyncFileWriter::getSyncBufferSize()
+{
+    return syncBufferSize;
+}
+
+// Gather synchronous appends in a buffer of size bytes and write it with one
+// pwrite() when it is full, and on flush(), syncFile() and closeFile(),
+// instead of making a syscall per write. The data is not in the file until
+// then. Writes with a callback, positional writes and writes as large as the
+// buffer go straight to the file after what was buffered. A size of 0 turns
+// the buffer off. Anything still buffered is written first. Returns -1 if
+// that fails or the buffer cannot be allocated.
+int AsyncFileWriter::setSyncBufferSize(size_t size)
+{
+    void *buffer = NULL;
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    if (size > 0 && posix_memalign(&buffer, SYNC_BUFFER_ALIGNMENT,
+                                   size) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    free(syncBuffer);
+    syncBuffer = (unsigned char *)buffer;
+    syncBufferSize = size;
+    return 0;
+}
+
+// Write out the buffer of buffered synchronous mode. If that fails, the data
+// is kept for the next try.
+int AsyncFileWriter::flushSyncBuffer()
+{
+    if (syncBufferUsed == 0) {
+        return 0;
+    }
+
+    TRACE(TRACE_SYSCALL_START, syncBufferOffset, syncBufferUsed);
+    ssize_t wbytes = pwriteAll(fd, syncBuffer, syncBufferUsed,
+                               syncBufferOffset);
+    TRACE(TRACE_SYSCALL_END, syncBufferOffset, wbytes);
+
+    if (wbytes != (ssize_t)syncBufferUsed) {
+        return -1;
+    }
+
+    syncBufferUsed = 0;
+    return 0;
+}
+
+bool AsyncFileWriter::getWriteError()
+{
+    return writeError;
+}
+
+BufferArena *AsyncFileWriter::getBufferArena()
+{
+    return bufferArena;
+}
+
+// Copy payloads into blocks from a BufferArena instead of malloc() memory.
+// This has to be set before the first write, and the arena must outlive the
+// writer.
+void AsyncFileWriter::setBufferArena(BufferArena *arena)
+{
+    bufferArena = arena;
+
+    if (bufferArena != NULL && numaNode != -1) {
+        bufferArena->setNumaNode(numaNode);
+    }
+}
+
+bool AsyncFileWriter::getDirectIO()
+{
+#ifdef O_DIRECT
+    return (openFlags & O_DIRECT) != 0;
+#else
+    return false;
+#endif
+}
+
+// Open the file with O_DIRECT where it is available. This has to be set
+// before openFile(). Direct I/O needs aligned buffers, so use it together
+// with a BufferArena, and every write offset and size has to be a multiple
+// of the device block size.
+void AsyncFileWriter::setDirectIO(bool value)
+{
+#ifdef O_DIRECT
+    if (value) {
+        openFlags |= O_DIRECT;
+    } else {
+        openFlags &= ~O_DIRECT;
+    }
+#endif
+}
+
+mode_t AsyncFileWriter::getFileMode()
+{
+    return openMode;
+}
+
+// Set the permissions a file created by openFile() gets, before the umask is
+// applied. This has to be set before openFile(). The default is 0644.
+void AsyncFileWriter::setFileMode(mode_t mode)
+{
+    openMode = mode;
+}
+
+int AsyncFileWriter::getWritePriority()
+{
+    return writePriority;
+}
+
+// Set the lane new writes are queued in, WRITE_PRIORITY_NORMAL or
+// WRITE_PRIORITY_BULK. Writes already queued keep their lane.
+int AsyncFileWriter::setWritePriority(int value)
+{
+    if (value != WRITE_PRIORITY_NORMAL && value != WRITE_PRIORITY_BULK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    writePriority = value;
+    return 0;
+}
+
+// Set the I/O priority class and level the open thread runs with. This has
+// to be set before openFile(). The AIO threads belong to the C library and
+// take the I/O priority of the thread that starts them, so to run the writes
+// themselves in a class, call setThreadIOPriority() from the thread that
+// submits them.
+int AsyncFileWriter::setIOPriority(int ioclass, int level)
+{
+    if (ioclass < IO_PRIORITY_REALTIME || ioclass > IO_PRIORITY_IDLE ||
+        level < 0 || level > 7) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ioPriorityClass = ioclass;
+    ioPriorityLevel = level;
+    return 0;
+}
+
+// Set the I/O priority of the calling thread with ioprio_set(2).
+int AsyncFileWriter::setThreadIOPriority(int ioclass, int level)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS with an id of 0 is the calling thread.
+    return syscall(SYS_ioprio_set, 1, 0, (ioclass << 13) | level);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Restrict the open thread to the given CPUs. This has to be set before
+// openFile(). It is only supported on Linux. The AIO threads belong to the C
+// library and inherit the affinity of the thread that starts them, which is
+// the thread submitting the writes.
+int AsyncFileWriter::setCpuAffinity(const int *cpus, int count)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+
+    for (int c = 0; c < count; c++) {
+        if (cpus[c] < 0 || cpus[c] >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        CPU_SET(cpus[c], &set);
+    }
+
+    cpuAffinity = set;
+    cpuAffinitySet = true;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Set the scheduling policy and priority of the open thread, for example
+// SCHED_FIFO for a writer that has to keep up with a realtime producer. This
+// has to be set before openFile().
+int AsyncFileWriter::setThreadScheduling(int policy, int priority)
+{
+    if (priority < sched_get_priority_min(policy) ||
+        priority > sched_get_priority_max(policy)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    schedulingPolicy = policy;
+    schedulingPriority = priority;
+    schedulingSet = true;
+    return 0;
+}
+
+int AsyncFileWriter::getNumaNode()
+{
+    return numaNode;
+}
+
+// Place the open thread and the payload buffers on a NUMA node, or with -1,
+// stop placing them. Unless a CPU affinity was set, the open thread is
+// restricted to the CPUs of the node, and the buffer arena, if there is one,
+// allocates its memory there. This has to be set before openFile().
+int AsyncFileWriter::setNumaNode(int node)
+{
+    if (node < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef __linux__
+    // The CPUs of the node are kept apart from the ones setCpuAffinity()
+    // sets, so moving to another node, or to none, replaces only them.
+    cpu_set_t set;
+    int count = 0;
+
+    CPU_ZERO(&set);
+
+    if (node != -1) {
+        // The CPUs of the node are listed as ranges, such as 0-7,16-23.
+        char path[64];
+        FILE *cpulist;
+        int first;
+        int last;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+
+        if ((cpulist = fopen(path, "r")) == NULL) {
+            return -1;
+        }
+
+        while (fscanf(cpulist, "%d", &first) == 1) {
+            last = first;
+
+            if (fscanf(cpulist, "-%d", &last) < 0) {
+                last = first;
+            }
+
+            for (int c = first; c <= last && c < CPU_SETSIZE; c++) {
+                CPU_SET(c, &set);
+                count++;
+            }
+
+            if (fgetc(cpulist) != ',') {
+                break;
+            }
+        }
+
+        fclose(cpulist);
+    }
+
+    numaAffinity = set;
+    numaAffinitySet = count > 0;
+#endif
+
+    numaNode = node;
+
+    if (bufferArena != NULL) {
+        bufferArena->setNumaNode(node);
+    }
+
+    return 0;
+}
+
+int AsyncFileWriter::getQueueProcessingInterval()
+{
+    return queueProcessingInterval;
+}
+
+void AsyncFileWriter::setQueueProcessingInterval(int value)
+{
+    queueProcessingInterval = value;
+}
+
+bool AsyncFileWriter::getAdaptiveQueueProcessing()
+{
+    return adaptiveProcessing;
+}
+
+// Let the writer pick the queue processing interval itself. It starts from
+// the current interval and is then tuned from the rate writes are submitted
+// and completed at, the bytes queued and how much of each scan of the queue
+// found completed writes. The queue is also processed early once half the
+// memory budget was submitted since the last pass. An interval of 0 still
+// disables processing the queue on write.
+void AsyncFileWriter::setAdaptiveQueueProcessing(bool value)
+{
+    adaptiveProcessing = value;
+}
+
+size_t AsyncFileWriter::getQueueMemoryBudget()
+{
+    return memoryBudget;
+}
+
+// Set the payload bytes adaptive queue processing tries to keep queued
+// under. The default is 16 MiB. A budget of 0 is no limit.
+void AsyncFileWriter::setQueueMemoryBudget(size_t value)
+{
+    memoryBudget = value;
+}
+
+long AsyncFileWriter::getQueueLatencyBudget()
+{
+    return latencyBudget;
+}
+
+// Set the longest time, in microseconds, adaptive queue processing tries to
+// let pass between processing passes, which bounds how late a completion is
+// noticed while writes are being submitted. The default of 0 is no limit.
+void AsyncFileWriter::setQueueLatencyBudget(long value)
+{
+    latencyBudget = value;
+}
+
+// Return the payload bytes of the writes still in the queue.
+size_t AsyncFileWriter::getQueuedBytes()
+{
+    return queuedBytes;
+}
+
+int AsyncFileWriter::write(const void *data, size_t count)
+{
+    return submit(data, count, true, NULL, NULL, -1, 0);
+}
+
+// Queue a write and call callback with context once it completes. The
+// callbacks run in batches from processQueue(), or from cancelWrites() with a
+// status of -1 if the write is canceled. In synchronous mode the callback
+// runs before this returns.
+int AsyncFileWriter::write(const void *data, size_t count,
+                           writeCallback callback, void *context)
+{
+    return submit(data, count, true, callback, context, -1, 0);
+}
+
+// Queue a write without copying the data. The caller must not modify or free
+// the data until getCompletedPrefix() shows the write has completed.
+int AsyncFileWriter::writeNoCopy(const void *data, size_t count)
+{
+    return submit(data, count, false, NULL, NULL, -1, 0);
+}
+
+int AsyncFileWriter::writeNoCopy(const void *data, size_t count,
+                                 writeCallback callback, void *context)
+{
+    return submit(data, count, false, callback, context, -1, 0);
+}
+
+// Queue the buffers of an iovec array as one write, as if they had been
+// concatenated first. They are gathered into a single copy, or written with
+// pwritev() in synchronous mode, and complete together with one callback.
+int AsyncFileWriter::writev(const struct iovec *iov, int iovcnt)
+{
+    return writev(iov, iovcnt, NULL, NULL);
+}
+
+int AsyncFileWriter::writev(const struct iovec *iov, int iovcnt,
+                            writeCallback callback, void *context)
+{
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return submitv(iov, iovcnt, true, callback, context, -1, 0);
+}
+
+// Queue a write at offset position instead of after the data written so far,
+// for data that arrives out of order. The append position is not changed.
+// Completion is tracked the same way as for the other writes.
+int AsyncFileWriter::writeAt(off_t position, const void *data, size_t count)
+{
+    return writeAt(position, data, count, NULL, NULL);
+}
+
+int AsyncFileWriter::writeAt(off_t position, const void *data, size_t count,
+                             writeCallback callback, void *context)
+{
+    if (position < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return submit(data, count, true, callback, context, position, 0);
+}
+
+int AsyncFileWriter::submit(const void *data, size_t count, bool copy,
+                            writeCallback callback, void *context,
+                            off_t position, size_t staging_size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = count;
+    return submitv(&iov, 1, copy, callback, context, position, staging_size);
+}
+
+int AsyncFileWriter::submitv(const struct iovec *iov, int iovcnt, bool copy,
+                             writeCallback callback, void *context,
+                             off_t position, size_t staging_size)
+{
+    bool append = position == -1;
+    size_t count = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (count + iov[i].iov_len < count) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        count += iov[i].iov_len;
+    }
+
+    // Data committed to the staging block comes before this write.
+    if (append && staging_size == 0 && stagingUsed > 0 && flush() == -1) {
+        return -1;
+    }
+
+    off_t write_offset = append ? offset : position;
+    TRACE(TRACE_SUBMIT, write_offset, count);
+
+    // Gather appends in the buffer of buffered synchronous mode. They are
+    // complete once they are copied.
+    if (synchronous && append && callback == NULL && count < syncBufferSize) {
+        if (fd == -1) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (syncBufferUsed + count > syncBufferSize &&
+            flushSyncBuffer() == -1) {
+            return -1;
+        }
+
+        if (syncBufferUsed == 0) {
+            syncBufferOffset = write_offset;
+        }
+
+        gather(syncBuffer + syncBufferUsed, iov, iovcnt);
+        syncBufferUsed += count;
+        TRACE(TRACE_COMPLETE, write_offset, count);
+        advanceOffset(append, write_offset, count);
+        return 0;
+    }
+
+    // Any other write goes to the file after the buffered data.
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    // Do a simple pwrite() if in synchronous mode.
+    if (synchronous) {
+        ssize_t wbytes = pwriteData(fd, iov, iovcnt, count, write_offset);
+
+        if (wbytes != (ssize_t)count) {
+            // Short writes are resumed by pwriteAll() and pwritevAll(), so
+            // this is a write error, such as ENOSPC.
+            return -1;
+        }
+
+        TRACE(TRACE_COMPLETE, write_offset, count);
+        advanceOffset(append, write_offset, count);
+
+        if (callback != NULL) {
+            callback(context, 0, count);
+        }
+
+        return 0;
+    }
+
+    // Check if there was an init error. This only happens if the mutex
+    // initialization failed.
+    if (initError) {
+        return -1;
+    }
+
+    int current_fd;
     // Check if there was an error in open().
     pthread_mutex_lock(&openedLock);
 
@@ -220,6 +1585,28 @@ int AsyncFileWriter::write(const void *data, size_t count)
 
     current_fd = fd;
     pthread_mutex_unlock(&openedLock);
+    double submit_time = 0;
+
+    // In adaptive dispatch, a small write to an empty queue can be written
+    // right away. If it is queued, its latency may be measured instead.
+    if (adaptiveDispatch && current_fd != -1 &&
+        count <= ADAPTIVE_DISPATCH_MAX_SZ) {
+        if (listHead == NULL && dispatchDirect()) {
+            return writeDirect(current_fd, iov, iovcnt, count, append,
+                               write_offset, callback, context, staging_size);
+        }
+
+        // Timing a queued write starts a notification thread for it, so
+        // only the probes of the queue, taken while direct writes are
+        // faster, and one in ADAPTIVE_DISPATCH_PROBE of the other queued
+        // writes are measured.
+        if (listHead == NULL && (directLatency <= queuedLatency ||
+                                 ++sampleProbe >= ADAPTIVE_DISPATCH_PROBE)) {
+            sampleProbe = 0;
+            submit_time = monotonicTime();
+        }
+    }
+
     aioBuffer *aio_buffer;
     void *aio_data;
 
@@ -227,30 +1614,76 @@ int AsyncFileWriter::write(const void *data, size_t count)
         return -1;
     }
 
-    if ((aio_data = malloc(count)) == NULL) {
-        free(aio_buffer);
-        return -1;
+    if (copy) {
+        if (bufferArena != NULL) {
+            aio_data = bufferArena->allocate(count);
+        } else {
+            aio_data = malloc(count);
+        }
+
+        if (aio_data == NULL) {
+            free(aio_buffer);
+            return -1;
+        }
+
+        gather((unsigned char *)aio_data, iov, iovcnt);
+    } else {
+        aio_data = iov[0].iov_base;
+    }
+
+    aio_buffer->ownsData = copy;
+    aio_buffer->stagingSize = staging_size;
+    aio_buffer->append = append;
+    aio_buffer->sequence = submitted;
+    aio_buffer->submitTime = 0;
+    aio_buffer->sample = NULL;
+
+    // The completion of a measured write is timed by its notification, so
+    // the latency does not include how long the caller took to reap it.
+    // Without memory for the sample, the write is not measured.
+    if (submit_time > 0) {
+        dispatchSample *sample =
+            (dispatchSample *)malloc(sizeof(dispatchSample));
+
+        if (sample != NULL &&
+            pthread_mutex_init(&sample->sampleLock, NULL) != 0) {
+            free(sample);
+            sample = NULL;
+        }
+
+        if (sample != NULL) {
+            sample->completeTime = 0;
+            sample->notifier = NULL;
+            sample->references = 1;
+            aio_buffer->submitTime = submit_time;
+            aio_buffer->sample = sample;
+        }
     }
 
-    memcpy(aio_data, data, count);
+    aio_buffer->callback = callback;
+    aio_buffer->callbackContext = context;
+    aio_buffer->written = 0;
+    aio_buffer->resubmitted = 0;
     aio_buffer->aiocb.aio_fildes = current_fd;
-    aio_buffer->aiocb.aio_offset = offset;
+    aio_buffer->aiocb.aio_offset = write_offset;
     aio_buffer->aiocb.aio_buf = aio_data;
     aio_buffer->aiocb.aio_nbytes = count;
-    aio_buffer->aiocb.aio_reqprio = 0;
+    aio_buffer->priority = writePriority;
+    aio_buffer->aiocb.aio_reqprio =
+        writePriority == WRITE_PRIORITY_BULK ? bulkRequestPriority : 0;
     aio_buffer->aiocb.aio_sigevent.sigev_notify = SIGEV_NONE;
     aio_buffer->aiocb.aio_lio_opcode = LIO_WRITE;
 
     // Issue the AIO write request.
     if (aio_buffer->aiocb.aio_fildes != -1) {
-        if (aio_write(&aio_buffer->aiocb) == 0) {
+        if (enqueueBuffer(aio_buffer) == 0) {
             aio_buffer->enqueued = true;
         } else {
             if (errno == EAGAIN) {
+                TRACE(TRACE_DEFER, write_offset, count);
                 aio_buffer->enqueued = false;
             } else {
-                free(aio_data);
-                free(aio_buffer);
+                freeBuffer(aio_buffer);
                 return -1;
             }
         }
@@ -271,16 +1704,23 @@ int AsyncFileWriter::write(const void *data, size_t count)
     }
 
     // Increment the offset for the next write and the submitted write count.
-    offset += count;
+    advanceOffset(append, write_offset, count);
     submitted += 1;
 
+    queuedBytes += count;
+    sinceProcessed++;
+    bytesSinceProcessed += count;
+
     // Process the queue every queueProcessingInterval requests. This will
     // free up memory as new writes are added to the queue. Before finishing,
     // processQueue() should be called by the caller while pendingWrites()
     // returns true. Setting the queueProcessingInterval to 0 cancels this
-    // behavior.
+    // behavior. In adaptive mode the queue is also processed once half the
+    // memory budget was submitted since the last pass.
     if (queueProcessingInterval > 0 &&
-        submitted % queueProcessingInterval == 0) {
+        (sinceProcessed >= queueProcessingInterval ||
+         (adaptiveProcessing && memoryBudget > 0 &&
+          bytesSinceProcessed >= memoryBudget / 2))) {
         if (processQueue() == -1) {
             return -1;
         }
@@ -289,6 +1729,131 @@ int AsyncFileWriter::write(const void *data, size_t count)
     return 0;
 }
 
+// Return a pointer to count bytes of writer owned memory to serialize a
+// record into, instead of building it in a buffer of its own that write()
+// then copies. Records are packed into staging blocks that come from the
+// buffer arena if there is one. Call commit() with the bytes actually used.
+// Reserving again without a commit() returns the same memory. Returns NULL if
+// no memory could be allocated.
+void *AsyncFileWriter::reserve(size_t count)
+{
+    if (stagingBlock != NULL && stagingSize - stagingUsed >= count) {
+        return stagingBlock + stagingUsed;
+    }
+
+    // Queue what was committed to the current block and start a new one.
+    if (flush() == -1) {
+        return NULL;
+    }
+
+    if (stagingBlock != NULL) {
+        releaseStagingBlock(stagingBlock, stagingSize);
+        stagingBlock = NULL;
+    }
+
+    size_t size = count > STAGING_BLOCK_SZ ? count : STAGING_BLOCK_SZ;
+
+    if ((stagingBlock = (unsigned char *)allocateStagingBlock(size)) == NULL) {
+        return NULL;
+    }
+
+    stagingSize = size;
+    stagingUsed = 0;
+    return stagingBlock;
+}
+
+// Commit count bytes of the memory returned by the last reserve(). They are
+// written, in commit order and after the data written so far, when the block
+// is full, or by flush() or processQueue().
+int AsyncFileWriter::commit(size_t count)
+{
+    if (stagingBlock == NULL || stagingSize - stagingUsed < count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stagingUsed += count;
+    return 0;
+}
+
+// Queue the data committed to the staging block. The block itself is written
+// without a copy and comes back for reuse once the write completes.
+int AsyncFileWriter::flush()
+{
+    if (stagingUsed == 0) {
+        return flushSyncBuffer();
+    }
+
+    if (synchronous) {
+        // The data is written or buffered before submit() returns, so the
+        // block can be used again right away.
+        size_t used = stagingUsed;
+
+        stagingUsed = 0;
+
+        if (submit(stagingBlock, used, false, NULL, NULL, -1, 0) == -1) {
+            return -1;
+        }
+
+        return flushSyncBuffer();
+    }
+
+    // The block belongs to the queue from here on.
+    unsigned char *block = stagingBlock;
+    size_t used = stagingUsed;
+    size_t size = stagingSize;
+    int64_t before = submitted;
+
+    stagingBlock = NULL;
+    stagingUsed = 0;
+    stagingSize = 0;
+
+    if (submit(block, used, false, NULL, NULL, -1, size) == -1) {
+        // A write can fail after it was queued, when the queue processing
+        // that follows it fails. The block is only freed here if nothing was
+        // queued.
+        if (submitted == before) {
+            releaseStagingBlock(block, size);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// Move the append position past a write, or only record the end of the
+// file for a positional write.
+void AsyncFileWriter::advanceOffset(bool append, off_t write_offset,
+                                    size_t count)
+{
+    if (append) {
+        offset += count;
+        trailingHole = false;
+    } else if (write_offset + (off_t)count > positionalEnd) {
+        positionalEnd = write_offset + count;
+    }
+}
+
+// Leave a hole of count bytes at the current position instead of writing
+// zeros. Nothing is queued, the next write simply starts further into the
+// file. If the file ends in a hole, closeFile() sets the final length.
+int AsyncFileWriter::writeHole(size_t count)
+{
+    // Data committed to the staging block comes before the hole.
+    if (flush() == -1) {
+        return -1;
+    }
+
+    offset += count;
+
+    if (count > 0) {
+        trailingHole = true;
+    }
+
+    return 0;
+}
+
 int AsyncFileWriter::processQueue()
 {
     // No processing is done unless the file has been opened.
@@ -300,18 +1865,108 @@ int AsyncFileWriter::processQueue()
     }
 
     pthread_mutex_unlock(&openedLock);
+
+    // Queue the staging block first so a drain loop on pendingWrites() gets
+    // it written. The flush can process the queue itself, which is fine.
+    if (stagingUsed > 0 && flush() == -1) {
+        return -1;
+    }
+
     int ret;
     aioBuffer *previous = NULL;
     aioBuffer *removal = NULL;
     aioBuffer *current = listHead;
+    // Completed buffers are moved to this list and finished after the scan.
+    aioBuffer *done = NULL;
+    aioBuffer *lastDone = NULL;
+    // Writes deferred for lack of AIO resources are retried with normal
+    // writes first. Bulk writes are only retried in a second pass if every
+    // normal write could be issued.
+    bool exhausted = false;
+    bool deferred_bulk = false;
+    bool failed = false;
+    // The errno processQueue() fails with, set after the callbacks have run.
+    int fail_errno = 0;
+    // The writes checked for completion and the ones found done, for
+    // adaptive queue processing.
+    int scanned = 0;
+    int reaped = 0;
+    // When the completions of this pass were seen, for adaptive dispatch.
+    double reap_time = 0;
 
     while (current != NULL) {
         if (current->enqueued == true) {
             ret = aio_error(&current->aiocb);
+            scanned++;
+
+            if (ret == EINPROGRESS) {
+                // Move on to the next buffer instead of waiting for this
+                // one. Later writes may already be done.
+                lastBuffer = current;
+                previous = current;
+                current = current->next;
+                continue;
+            }
+
+            ssize_t written = aio_return(&current->aiocb);
+
+            if (ret == 0 && written > 0 &&
+                written < (ssize_t)current->aiocb.aio_nbytes) {
+                // A short write keeps its place in the queue and is
+                // resubmitted for the rest of its data.
+                if (resubmitBuffer(current, written, &exhausted) == -1) {
+                    completeBuffers(done);
+                    return -1;
+                }
+
+                lastBuffer = current;
+                previous = current;
+                current = current->next;
+            } else {
+                // A failed write, for example with ENOSPC, is finished with
+                // an error status. The rest of the queue carries on. A write
+                // that completed without writing anything failed as well,
+                // with no error code of its own.
+                bool write_failed =
+                    ret != 0 || written != (ssize_t)current->aiocb.aio_nbytes;
 
-            if (ret == 0) {
-                aio_return(&current->aiocb);
+                if (write_failed) {
+                    fail_errno = ret > 0 ? ret : EIO;
+                    writeError = true;
+                    failed = true;
+                }
+
+                current->written = written;
                 completed++;
+                reaped++;
+
+                if (current->submitTime > 0) {
+                    if (reap_time == 0) {
+                        reap_time = monotonicTime();
+                    }
+
+                    // The notification may not have run yet, in which case
+                    // the reap time is the closest there is.
+                    double complete_time = reap_time;
+                    dispatchSample *sample = current->sample;
+
+                    pthread_mutex_lock(&sample->sampleLock);
+
+                    if (sample->completeTime > 0 &&
+                        sample->completeTime < complete_time) {
+                        complete_time = sample->completeTime;
+                    }
+
+                    pthread_mutex_unlock(&sample->sampleLock);
+                    queuedLatency += (complete_time - current->submitTime -
+                                      queuedLatency) *
+                                     ADAPTIVE_DISPATCH_WEIGHT;
+                }
+
+                TRACE(TRACE_COMPLETE,
+                      current->aiocb.aio_offset - current->resubmitted,
+                      write_failed ? -1 : (int64_t)(current->resubmitted +
+                                                    written));
 
                 // If we are at the head of the list, advance the head. This
                 // is fine even if current->next is NULL.
@@ -322,8 +1977,6 @@ int AsyncFileWriter::processQueue()
                     lastBuffer = current->next;
                     removal = current;
                     current = current->next;
-                    free((void *)removal->aiocb.aio_buf);
-                    free(removal);
                 } else {
                     // If this is the last buffer in the queue, lastBuffer will
                     // point to the last valid buffer after removal below.
@@ -331,25 +1984,25 @@ int AsyncFileWriter::processQueue()
                     previous->next = current->next;
                     removal = current;
                     current = current->next;
-                    free((void *)removal->aiocb.aio_buf);
-                    free(removal);
                 }
-            } else if (ret != EINPROGRESS) {
-                return -1;
-            }
-        } else {
-            // Set the file descriptor in the case where this was created
-            // before the file was opened.
-            current->aiocb.aio_fildes = fd;
 
-            if (aio_write(&current->aiocb) == 0) {
-                current->enqueued = true;
-            } else {
-                // Do nothing if there still are no resources, otherwise there
-                // is a failure from which we cannot recover.
-                if (errno != EAGAIN) {
-                    return -1;
+                // Keep the buffer for completeBuffers() after the scan.
+                removal->next = NULL;
+
+                if (lastDone == NULL) {
+                    done = removal;
+                } else {
+                    lastDone->next = removal;
                 }
+
+                lastDone = removal;
+            }
+        } else {
+            if (current->priority == WRITE_PRIORITY_BULK) {
+                deferred_bulk = true;
+            } else if (!exhausted && retryBuffer(current, &exhausted) == -1) {
+                completeBuffers(done);
+                return -1;
             }
 
             // Advance lastBuffer in case it was set in the removal of buffers
@@ -360,35 +2013,428 @@ int AsyncFileWriter::processQueue()
         }
     }
 
+    for (current = listHead; deferred_bulk && !exhausted && current != NULL;
+         current = current->next) {
+        if (!current->enqueued &&
+            retryBuffer(current, &exhausted) == -1) {
+            completeBuffers(done);
+            return -1;
+        }
+    }
+
+    if (sinceProcessed > 0) {
+        if (adaptiveProcessing) {
+            adaptInterval(scanned, reaped);
+        }
+
+        sinceProcessed = 0;
+        bytesSinceProcessed = 0;
+    }
+
+    completeBuffers(done);
+
+    if (failed) {
+        errno = fail_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Tune queueProcessingInterval after a processQueue() pass that checked
+// scanned writes and found reaped of them done. The interval is the number of
+// writes, at the current average size and rate, that fit in what is left of
+// the memory budget and in the latency budget. If most of the scan was wasted
+// on writes still in progress, the device is behind and processing more
+// often would not free memory any sooner, so the interval backs off instead.
+void AsyncFileWriter::adaptInterval(int scanned, int reaped)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ts.tv_sec + ts.tv_nsec / 1e9;
+    double elapsed = now - lastProcessed;
+    long interval = MAX_QUEUE_PROCESSING_INTERVAL;
+    size_t average = bytesSinceProcessed / sinceProcessed;
+
+    if (memoryBudget > 0 && average > 0) {
+        size_t room = memoryBudget > queuedBytes ? memoryBudget - queuedBytes
+                                                 : 0;
+
+        if (room / average < (size_t)interval) {
+            interval = (long)(room / average);
+        }
+    }
+
+    // The first pass has no previous one to measure the rate from.
+    if (latencyBudget > 0 && lastProcessed > 0 && elapsed > 0) {
+        double writes = sinceProcessed / elapsed * latencyBudget / 1e6;
+
+        if (writes < interval) {
+            interval = (long)writes;
+        }
+    }
+
+    if (scanned > 0 && reaped * 4 < scanned &&
+        interval < (long)queueProcessingInterval * 2) {
+        interval = (long)queueProcessingInterval * 2;
+
+        if (interval > MAX_QUEUE_PROCESSING_INTERVAL) {
+            interval = MAX_QUEUE_PROCESSING_INTERVAL;
+        }
+    }
+
+    queueProcessingInterval = interval < 1 ? 1 : (int)interval;
+    lastProcessed = now;
+}
+
+// Issue a write deferred by submit(). If there still are no AIO resources,
+// exhausted is set so no other write is retried in this pass. Any other
+// failure cannot be recovered from and sets the write error.
+int AsyncFileWriter::retryBuffer(aioBuffer *buffer, bool *exhausted)
+{
+    // Set the file descriptor in the case where this was created before the
+    // file was opened.
+    buffer->aiocb.aio_fildes = fd;
+    TRACE(TRACE_DEQUEUE, buffer->aiocb.aio_offset, buffer->aiocb.aio_nbytes);
+
+    if (enqueueBuffer(buffer) == 0) {
+        buffer->enqueued = true;
+        return 0;
+    }
+
+    if (errno == EAGAIN) {
+        TRACE(TRACE_DEFER, buffer->aiocb.aio_offset,
+              buffer->aiocb.aio_nbytes);
+        *exhausted = true;
+        return 0;
+    }
+
+    writeError = true;
+    return -1;
+}
+
+// Resubmit the rest of a write that completed short. If AIO is out of
+// resources, it waits with the deferred writes instead.
+int AsyncFileWriter::resubmitBuffer(aioBuffer *buffer, size_t written,
+                                    bool *exhausted)
+{
+    buffer->aiocb.aio_buf = (unsigned char *)buffer->aiocb.aio_buf + written;
+    buffer->aiocb.aio_offset += written;
+    buffer->aiocb.aio_nbytes -= written;
+    buffer->resubmitted += written;
+    buffer->enqueued = false;
+
+    // A short write is not measured. Its first notification holds its own
+    // reference to the sample.
+    if (buffer->sample != NULL) {
+        releaseSample(buffer->sample);
+        buffer->sample = NULL;
+        buffer->submitTime = 0;
+    }
+
+    if (*exhausted) {
+        return 0;
+    }
+
+    return retryBuffer(buffer, exhausted);
+}
+
+// Return a file descriptor that becomes readable when writes complete, which
+// is also when queue space frees up. It can be added to an epoll, poll or
+// select loop, which then calls clearCompletionFd() and processQueue() when it
+// is readable. The first call creates it, and only writes submitted after
+// that signal it, so call this before the first write. Returns -1 if it
+// cannot be created.
+//
+// Each AIO request signals it from a notification thread started by the AIO
+// implementation, which costs a thread start per write.
+int AsyncFileWriter::getCompletionFd()
+{
+    if (notifier != NULL) {
+        return notifier->readFd;
+    }
+
+    completionNotifier *completion;
+
+    if ((completion = (completionNotifier *)malloc(
+             sizeof(completionNotifier))) == NULL) {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&completion->notifierLock, NULL) != 0) {
+        free(completion);
+        return -1;
+    }
+
+#ifdef __linux__
+    completion->readFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    completion->writeFd = completion->readFd;
+
+    if (completion->readFd == -1) {
+        pthread_mutex_destroy(&completion->notifierLock);
+        free(completion);
+        return -1;
+    }
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        pthread_mutex_destroy(&completion->notifierLock);
+        free(completion);
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    completion->readFd = fds[0];
+    completion->writeFd = fds[1];
+#endif
+
+    // The writer holds one reference until it is destroyed.
+    completion->references = 1;
+    notifier = completion;
+    return notifier->readFd;
+}
+
+// Reset the completion fd so it is no longer readable. Call this before
+// processQueue() so no completion is missed.
+void AsyncFileWriter::clearCompletionFd()
+{
+    if (notifier == NULL) {
+        return;
+    }
+
+    char data[64];
+
+    while (read(notifier->readFd, data, sizeof(data)) > 0);
+}
+
+// Sleep until the oldest write being written completes, for at most timeout
+// microseconds, 0 being no limit, so a caller waiting for its writes does
+// not have to poll processQueue() in a loop. Writes queued before the file
+// is open wait for the open first. Call processQueue() afterwards to reap
+// the write. This returns right away if no write is in progress, and
+// returns -1 with errno set to ETIMEDOUT if the time ran out.
+int AsyncFileWriter::waitForCompletion(long timeout)
+{
+    struct timespec ts;
+    struct timespec wait;
+    struct timespec *wait_time = NULL;
+
+    if (timeout > 0) {
+        wait.tv_sec = timeout / 1000000;
+        wait.tv_nsec = timeout % 1000000 * 1000;
+        wait_time = &wait;
+    }
+
+    pthread_mutex_lock(&openedLock);
+
+    if (openStarted && !opened) {
+        if (timeout > 0) {
+            // The condition variable waits on the realtime clock.
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += wait.tv_sec;
+            ts.tv_nsec += wait.tv_nsec;
+
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+        }
+
+        while (!opened) {
+            if (timeout == 0) {
+                pthread_cond_wait(&openedCond, &openedLock);
+            } else if (pthread_cond_timedwait(&openedCond, &openedLock,
+                                              &ts) == ETIMEDOUT) {
+                pthread_mutex_unlock(&openedLock);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        // The writes queued so far are issued by the next processQueue().
+        pthread_mutex_unlock(&openedLock);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&openedLock);
+
+    for (aioBuffer *current = listHead; current != NULL;
+         current = current->next) {
+        const struct aiocb *request = &current->aiocb;
+
+        if (!current->enqueued) {
+            continue;
+        }
+
+        if (aio_error(request) != EINPROGRESS) {
+            return 0;
+        }
+
+        // A signal only ends the wait early.
+        if (aio_suspend(&request, 1, wait_time) == -1 && errno == EAGAIN) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        return 0;
+    }
+
     return 0;
 }
 
-int AsyncFileWriter::queueSize()
+int64_t AsyncFileWriter::queueSize()
 {
     return submitted - completed;
 }
 
 void AsyncFileWriter::cancelWrites()
 {
+    cancelWrites(0, false);
+}
+
+// Cancel the queued writes and wait for the ones already being written,
+// which cannot be canceled. The wait sleeps in aio_suspend() and gives up
+// after timeout microseconds, 0 being no limit. Writes that finished run
+// their callbacks with their result, canceled ones with -1. The file is then
+// removed, or with keepCompleted, truncated to the end of the appends done
+// before the first one that was not. Positional writes never truncate it.
+// Returns -1 with errno set to ETIMEDOUT if writes were still in progress at
+// the deadline. They stay queued, and calling this again finishes the job.
+int AsyncFileWriter::cancelWrites(long timeout, bool keep_completed)
+{
+    struct timespec ts;
+    double deadline = 0;
+    aioBuffer *done = NULL;
+    aioBuffer *last_done = NULL;
+    aioBuffer *kept = NULL;
+    aioBuffer *last_kept = NULL;
+
+    if (listHead == NULL) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    deadline = ts.tv_sec + ts.tv_nsec / 1e9 + timeout / 1e6;
+
+    // Cancel any outstanding AIO requests. The ones being written are waited
+    // for below instead of retrying the cancel in a loop.
+    if (fd != -1) {
+        aio_cancel(fd, NULL);
+    }
+
+    for (aioBuffer *current = listHead; current != NULL;
+         current = current->next) {
+        const struct aiocb *request = &current->aiocb;
+        bool expired = false;
+
+        while (current->enqueued && aio_error(request) == EINPROGRESS) {
+            struct timespec wait;
+            struct timespec *wait_time = NULL;
+
+            if (timeout > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                double left = deadline - (ts.tv_sec + ts.tv_nsec / 1e9);
+
+                if (left <= 0) {
+                    expired = true;
+                    break;
+                }
+
+                wait.tv_sec = (time_t)left;
+                wait.tv_nsec = (long)((left - wait.tv_sec) * 1e9);
+                wait_time = &wait;
+            }
+
+            // Sleep until the request finishes, the time is up or a signal
+            // arrives.
+            aio_suspend(&request, 1, wait_time);
+        }
+
+        if (expired) {
+            break;
+        }
+    }
+
+    // Split the queue into the finished buffers and the ones still being
+    // written.
+    aioBuffer *current = listHead;
+
+    while (current != NULL) {
+        aioBuffer *buffer = current;
+
+        current = current->next;
+        buffer->next = NULL;
+
+        if (buffer->enqueued && aio_error(&buffer->aiocb) == EINPROGRESS) {
+            if (kept == NULL) {
+                kept = buffer;
+            } else {
+                last_kept->next = buffer;
+            }
+
+            last_kept = buffer;
+            continue;
+        }
+
+        buffer->written = buffer->enqueued ? aio_return(&buffer->aiocb) : -1;
+
+        // Only appends move the end of the data. A positional write below it
+        // must not cut off the appends that were written.
+        if (buffer->append &&
+            buffer->written != (ssize_t)buffer->aiocb.aio_nbytes &&
+            (canceledFrom == -1 || buffer->aiocb.aio_offset < canceledFrom)) {
+            canceledFrom = buffer->aiocb.aio_offset;
+        }
+
+        if (done == NULL) {
+            done = buffer;
+        } else {
+            last_done->next = buffer;
+        }
+
+        last_done = buffer;
+        completed++;
+    }
+
+    listHead = kept;
+    lastBuffer = last_kept;
+    completeBuffers(done);
+
     if (listHead != NULL) {
-        // Cancel any outstanding AIO requets if any exist. Keep trying
-        // until they are all canceled. This should only repeat if there is
-        // one or a couple of outstanding requests in the process of writing.
-        // It will not make this a long blocking call.
-        while (aio_cancel(fd, NULL) == AIO_NOTCANCELED);
-
-        // Free any remaining AIO blocks.
-        aioBuffer *removal;
-        aioBuffer *current = listHead;
-
-        while (current != NULL) {
-            removal = current;
-            current = current->next;
-            free((void *)removal->aiocb.aio_buf);
-            free(removal);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    // Nothing writes to the file any more.
+    if (!keep_completed) {
+        // Unlink the file in the background. It is only done here if that
+        // cannot be queued.
+        if (queueOperation(FILE_OPERATION_UNLINK, -1, NULL, NULL,
+                           NULL) == -1) {
+            unlink(filename);
+        }
+    } else if (canceledFrom != -1) {
+        // Cut the file at the first write that did not complete in the
+        // background. Appending carries on from there.
+        if (queueOperation(FILE_OPERATION_TRUNCATE, canceledFrom, NULL, NULL,
+                           NULL) == -1 && fd != -1 &&
+            ftruncate(fd, canceledFrom) == -1) {
+            // The file keeps the canceled writes' length.
         }
 
-        // Unlink the file.
-        unlink(filename);
+        offset = canceledFrom;
+        trailingHole = false;
+
+        if (positionalEnd > canceledFrom) {
+            positionalEnd = canceledFrom;
+        }
     }
+
+    canceledFrom = -1;
+    return 0;
 }
@@ -21,19 +21,21 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    int count = (int)strtol(argv[1], (char **)NULL, 10);
+    long long count = strtoll(argv[1], (char **)NULL, 10);
     AsyncFileWriter *asyncFileWriter = new AsyncFileWriter("test-file.txt");
     // The default queue processing interval is 40 writes.
     //asyncFileWriter->setQueueProcessingInterval(1000);
     // Disable processing the queue.
     //asyncFileWriter->setQueueProcessingInterval(0);
+    // Tune the interval from the completion rate and a memory budget.
+    //asyncFileWriter->setAdaptiveQueueProcessing(true);
 
     if (asyncFileWriter->openFile() == -1) {
         perror("asyncFileWriter.openFile()");
         return 1;
     }
 
-    for (int t = 0; t < count; t++) {
+    for (long long t = 0; t < count; t++) {
         if (asyncFileWriter->write("Hello World\n", 12) == -1) {
             perror("asyncFileWriter.write() error");
             asyncFileWriter->cancelWrites();
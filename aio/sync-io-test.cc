@@ -7,30 +7,42 @@ using namespace std;
 void usage()
 {
     cout << endl;
-    cout << "Usage: %s <write count>" << endl;
+    cout << "Usage: %s <write count> [buffer bytes]" << endl;
     cout << endl;
     cout << "The \"write count\" value indicates how many lines of \"Hello World\" will be" << endl;
-    cout << "written to ./test-file.txt synchronously." << endl;
+    cout << "written to ./test-file.txt synchronously. With \"buffer bytes\", the lines are" << endl;
+    cout << "gathered in a buffer of that size and written a buffer at a time." << endl;
     cout << endl;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         usage();
         return -1;
     }
 
-    int count = (int)strtol(argv[1], (char **)NULL, 10);
+    long long count = strtoll(argv[1], (char **)NULL, 10);
+    size_t buffer_size = 0;
+
+    if (argc == 3) {
+        buffer_size = (size_t)strtoll(argv[2], (char **)NULL, 10);
+    }
+
     AsyncFileWriter *asyncFileWriter = new AsyncFileWriter("test-file.txt");
     asyncFileWriter->setSynchronous(true);
 
+    if (asyncFileWriter->setSyncBufferSize(buffer_size) == -1) {
+        perror("asyncFileWriter.setSyncBufferSize()");
+        return 1;
+    }
+
     if (asyncFileWriter->openFile() == -1) {
         perror("asyncFileWriter.openFile()");
         return 1;
     }
 
-    for (int t = 0; t < count; t++) {
+    for (long long t = 0; t < count; t++) {
         if (asyncFileWriter->write("Hello World\n", 12) == -1) {
             perror("asyncFileWriter.write() error");
             delete asyncFileWriter;
@@ -40,7 +52,12 @@ int main(int argc, char **argv)
 
     // The destructor will also close the file, but it's best to do so
     // explicity IMO.
-    asyncFileWriter->closeFile();
+    if (asyncFileWriter->closeFile() == -1) {
+        perror("asyncFileWriter.closeFile()");
+        delete asyncFileWriter;
+        return 1;
+    }
+
     delete asyncFileWriter;
     return 0;
 }
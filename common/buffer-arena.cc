@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "buffer-arena.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+// Return the size class of a block, the power of two multiple of
+// ARENA_ALIGNMENT that holds size bytes.
+static int sizeClass(size_t size)
+{
+    int size_class = 0;
+    size_t block_size = ARENA_ALIGNMENT;
+
+    while (block_size < size) {
+        block_size <<= 1;
+        size_class++;
+    }
+
+    return size_class;
+}
+
+BufferArena::BufferArena()
+{
+    for (int c = 0; c < ARENA_CLASSES; c++) {
+        freeLists[c] = NULL;
+    }
+
+    chunks = NULL;
+    current = NULL;
+    remaining = 0;
+    numaNode = -1;
+    hugePages = false;
+    initError = false;
+
+    if (pthread_mutex_init(&arenaLock, NULL) != 0) {
+        initError = true;
+    }
+}
+
+BufferArena::~BufferArena()
+{
+    // Any block still in use by a writer becomes invalid here. The arena has
+    // to outlive the writers that use it.
+    arenaChunk *removal;
+    arenaChunk *chunk = chunks;
+
+    while (chunk != NULL) {
+        removal = chunk;
+        chunk = chunk->next;
+        munmap(removal->addr, removal->length);
+        free(removal);
+    }
+
+    pthread_mutex_destroy(&arenaLock);
+}
+
+// Map length bytes, a multiple of ARENA_CHUNK_SZ, aligned to a huge page.
+// Reserved huge pages are used if there are any, otherwise transparent huge
+// pages are requested. The memory is placed on the arena's NUMA node, or on
+// the node of the calling thread if none was set. It is not touched here, so
+// nothing is faulted in on the wrong node first.
+void *BufferArena::mapChunk(size_t length)
+{
+    void *addr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    addr = mmap(NULL, length, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+
+    if (addr != MAP_FAILED) {
+        hugePages = true;
+    }
+#endif
+
+    if (addr == MAP_FAILED) {
+        // Map an extra chunk so the start can be moved to a huge page
+        // boundary. Transparent huge pages are only used for aligned ranges.
+        size_t mapped = length + ARENA_CHUNK_SZ;
+        unsigned char *raw = (unsigned char *)mmap(NULL, mapped,
+                                                   PROT_READ|PROT_WRITE,
+                                                   MAP_PRIVATE|MAP_ANONYMOUS,
+                                                   -1, 0);
+
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+
+        unsigned char *start = (unsigned char *)(((uintptr_t)raw +
+            ARENA_CHUNK_SZ - 1) & ~(uintptr_t)(ARENA_CHUNK_SZ - 1));
+        size_t head = start - raw;
+        size_t tail = mapped - head - length;
+
+        if (head > 0) {
+            munmap(raw, head);
+        }
+
+        if (tail > 0) {
+            munmap(start + length, tail);
+        }
+
+        addr = start;
+#ifdef MADV_HUGEPAGE
+        if (madvise(addr, length, MADV_HUGEPAGE) == 0) {
+            hugePages = true;
+        }
+#endif
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    int node = numaNode;
+
+    if (node == -1) {
+        unsigned int cpu;
+        unsigned int current_node;
+
+        if (syscall(SYS_getcpu, &cpu, &current_node, NULL) == 0) {
+            node = current_node;
+        }
+    }
+
+    if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long mask = 1UL << node;
+
+        // MPOL_PREFERRED falls back to other nodes instead of failing when
+        // the node is out of memory. The kernel ignores the last bit of
+        // maxnode, hence the + 1. A failure here only costs locality.
+        syscall(SYS_mbind, addr, length, MPOL_PREFERRED, &mask,
+                sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+
+    return addr;
+}
+
+// Allocate a block of at least size bytes aligned to ARENA_ALIGNMENT. Blocks
+// larger than a chunk get their own mapping. Returns NULL on failure.
+void *BufferArena::allocate(size_t size)
+{
+    if (initError) {
+        return NULL;
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    pthread_mutex_lock(&arenaLock);
+
+    if (size > ARENA_CHUNK_SZ) {
+        size_t length = (size + ARENA_CHUNK_SZ - 1) &
+                        ~(size_t)(ARENA_CHUNK_SZ - 1);
+        void *addr = mapChunk(length);
+        pthread_mutex_unlock(&arenaLock);
+        return addr;
+    }
+
+    int size_class = sizeClass(size);
+    size_t block_size = (size_t)ARENA_ALIGNMENT << size_class;
+    freeBlock *block = freeLists[size_class];
+
+    if (block != NULL) {
+        freeLists[size_class] = block->next;
+        pthread_mutex_unlock(&arenaLock);
+        return block;
+    }
+
+    if (remaining < block_size) {
+        arenaChunk *chunk;
+        void *addr;
+
+        if ((chunk = (arenaChunk *)malloc(sizeof(arenaChunk))) == NULL) {
+            pthread_mutex_unlock(&arenaLock);
+            return NULL;
+        }
+
+        if ((addr = mapChunk(ARENA_CHUNK_SZ)) == NULL) {
+            free(chunk);
+            pthread_mutex_unlock(&arenaLock);
+            return NULL;
+        }
+
+        // Hand the rest of the old chunk to the free lists so it is not
+        // wasted. It is always a multiple of ARENA_ALIGNMENT.
+        while (remaining > 0) {
+            int c = ARENA_CLASSES - 1;
+
+            while (((size_t)ARENA_ALIGNMENT << c) > remaining) {
+                c--;
+            }
+
+            freeBlock *leftover = (freeBlock *)current;
+            leftover->next = freeLists[c];
+            freeLists[c] = leftover;
+            current += (size_t)ARENA_ALIGNMENT << c;
+            remaining -= (size_t)ARENA_ALIGNMENT << c;
+        }
+
+        chunk->addr = addr;
+        chunk->length = ARENA_CHUNK_SZ;
+        chunk->next = chunks;
+        chunks = chunk;
+        current = (unsigned char *)addr;
+        remaining = ARENA_CHUNK_SZ;
+    }
+
+    void *addr = current;
+    current += block_size;
+    remaining -= block_size;
+    pthread_mutex_unlock(&arenaLock);
+    return addr;
+}
+
+// Return a block to the arena. The size has to be the one it was allocated
+// with.
+void BufferArena::release(void *addr, size_t size)
+{
+    if (addr == NULL) {
+        return;
+    }
+
+    if (size > ARENA_CHUNK_SZ) {
+        munmap(addr, (size + ARENA_CHUNK_SZ - 1) &
+                     ~(size_t)(ARENA_CHUNK_SZ - 1));
+        return;
+    }
+
+    int size_class = sizeClass(size == 0 ? 1 : size);
+    freeBlock *block = (freeBlock *)addr;
+    pthread_mutex_lock(&arenaLock);
+    block->next = freeLists[size_class];
+    freeLists[size_class] = block;
+    pthread_mutex_unlock(&arenaLock);
+}
+
+size_t BufferArena::getAlignment()
+{
+    return ARENA_ALIGNMENT;
+}
+
+int BufferArena::getNumaNode()
+{
+    return numaNode;
+}
+
+// Set the NUMA node new chunks are placed on. The default of -1 uses the node
+// of the thread that allocates the chunk.
+void BufferArena::setNumaNode(int value)
+{
+    pthread_mutex_lock(&arenaLock);
+    numaNode = value;
+    pthread_mutex_unlock(&arenaLock);
+}
+
+// Return true if huge pages were obtained for at least one chunk, either
+// reserved or transparent.
+bool BufferArena::getHugePages()
+{
+    bool huge;
+
+    pthread_mutex_lock(&arenaLock);
+    huge = hugePages;
+    pthread_mutex_unlock(&arenaLock);
+
+    return huge;
+}
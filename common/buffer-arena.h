@@ -0,0 +1,56 @@
+#ifndef _BufferArena_H
+#define _BufferArena_H
+
+#include <cstddef>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+using namespace std;
+
+// The arena maps memory ARENA_CHUNK_SZ bytes at a time. This is the size of a
+// huge page on x86-64 and most ARM64 kernels.
+#define ARENA_CHUNK_SZ      (2 * 1024 * 1024)
+// Every block handed out is aligned to ARENA_ALIGNMENT bytes, which is enough
+// for O_DIRECT on any common device.
+#define ARENA_ALIGNMENT     4096
+// Block sizes are powers of two from ARENA_ALIGNMENT up to ARENA_CHUNK_SZ.
+#define ARENA_CLASSES       10
+
+class BufferArena {
+private:
+    typedef struct arenaChunk {
+        void            *addr;
+        size_t          length;
+        arenaChunk      *next;
+    } arenaChunk;
+
+    typedef struct freeBlock {
+        freeBlock       *next;
+    } freeBlock;
+
+    freeBlock           *freeLists[ARENA_CLASSES];
+    arenaChunk          *chunks;
+    unsigned char       *current;
+    size_t              remaining;
+    int                 numaNode;
+    bool                hugePages;
+    bool                initError;
+    // The writer threads release blocks while the caller allocates them, so
+    // the free lists are protected.
+    pthread_mutex_t     arenaLock;
+
+    void *mapChunk(size_t);
+
+public:
+    BufferArena();
+    ~BufferArena();
+    void *allocate(size_t);
+    void release(void *, size_t);
+    size_t getAlignment();
+    int getNumaNode();
+    void setNumaNode(int);
+    bool getHugePages();
+};
+
+#endif
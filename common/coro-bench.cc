@@ -0,0 +1,131 @@
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+#include <poll.h>
+#include <exception>
+#include "coroutine-file-writer.h"
+
+using namespace std;
+
+typedef CoroutineFileWriter<FILE_WRITER_ENGINE> DefaultCoroutineFileWriter;
+
+// A coroutine that starts right away and cleans up after itself. This is all
+// the handlers below need.
+struct Task {
+    struct promise_type {
+        Task get_return_object()
+        {
+            return Task();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+void usage()
+{
+    cout << endl;
+    cout << "Usage: %s <handlers> <writes per handler>" << endl;
+    cout << endl;
+    cout << "Runs \"handlers\" coroutines on one thread. Each one writes a line of" << endl;
+    cout << "\"Hello World\" to ./test-file.txt and waits for it to complete before" << endl;
+    cout << "writing the next one." << endl;
+    cout << endl;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Task handler(DefaultCoroutineFileWriter *writer, long writes, int *failures,
+             int *finished)
+{
+    for (long t = 0; t < writes; t++) {
+        if (co_await writer->asyncWrite("Hello World\n", 12) == -1) {
+            (*failures)++;
+            break;
+        }
+    }
+
+    (*finished)++;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        usage();
+        return -1;
+    }
+
+    int handlers = (int)strtol(argv[1], (char **)NULL, 10);
+    long writes = strtol(argv[2], (char **)NULL, 10);
+    int failures = 0;
+    int finished = 0;
+    DefaultCoroutineFileWriter *writer =
+        new DefaultCoroutineFileWriter("test-file.txt");
+    double start = now();
+
+    // The completion fd has to exist before the first write to be signaled
+    // by it.
+    struct pollfd completion;
+    completion.fd = writer->getCompletionFd();
+    completion.events = POLLIN;
+
+    if (writer->openFile() == -1) {
+        perror("writer.openFile()");
+        return 1;
+    }
+
+    for (int h = 0; h < handlers; h++) {
+        handler(writer, writes, &failures, &finished);
+    }
+
+    // The event loop. Every pass resumes the handlers whose writes are done
+    // and then sleeps until more writes complete. The timeout only matters
+    // if the completion fd could not be created.
+    while (finished < handlers) {
+        writer->clearCompletionFd();
+
+        if (writer->reap() == 0) {
+            poll(&completion, completion.fd == -1 ? 0 : 1, 1);
+        }
+    }
+
+    double elapsed = now() - start;
+    writer->closeFile();
+
+    cout << "Backend:    " << ASYNC_FILE_WRITER_BACKEND << endl;
+    cout << "Engine:     " << DefaultCoroutineFileWriter::engineName() << endl;
+    cout << "Handlers:   " << handlers << endl;
+    cout << "Completed:  " << writer->getCompleted() << endl;
+    cout << "Total:      " << elapsed << " s" << endl;
+    delete writer;
+
+    if (failures > 0) {
+        cout << "Failed:     " << failures << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef _CoroutineFileWriter_H
+#define _CoroutineFileWriter_H
+
+#include "file-writer.h"
+
+// Coroutines need C++20. The rest of the tree builds as C++11, so this header
+// is empty unless the compiler has coroutine support.
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <deque>
+
+// A FileWriter with awaitable writes:
+//
+//     if (co_await writer.asyncWrite(data, count) == -1) { ... }
+//     co_await writer.flush();
+//
+// A suspended coroutine is resumed from reap() once its write has completed,
+// on the thread that calls reap(). Completion is taken from the writer's
+// completed prefix, so a coroutine only resumes when every write submitted
+// before its own is on the file as well. One thread can keep any number of
+// coroutines, and writes, in flight and resume each one exactly when it is
+// done instead of polling per write.
+template <class Engine>
+class CoroutineFileWriter : public FileWriter<Engine> {
+private:
+    typedef struct coroutineWaiter {
+        int64_t                     target;
+        std::coroutine_handle<>     handle;
+        int                         *status;
+    } coroutineWaiter;
+
+    // Waiters are added in submission order, so the ones that can resume are
+    // always at the front.
+    std::deque<coroutineWaiter>     waiters;
+
+public:
+    class WriteAwaiter {
+    private:
+        CoroutineFileWriter         *writer;
+        int64_t                     target;
+        int                         status;
+
+    public:
+        WriteAwaiter(CoroutineFileWriter *writer, int64_t target,
+                     int status)
+            : writer(writer), target(target), status(status)
+        {
+        }
+
+        bool await_ready()
+        {
+            return status == -1 || writer->getCompletedPrefix() >= target;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            coroutineWaiter waiter;
+
+            waiter.target = target;
+            waiter.handle = handle;
+            waiter.status = &status;
+            writer->waiters.push_back(waiter);
+        }
+
+        // Returns 0 once the write is complete or -1 if it failed.
+        int await_resume()
+        {
+            return status;
+        }
+    };
+
+    CoroutineFileWriter(const char *filename) : FileWriter<Engine>(filename)
+    {
+    }
+
+    // Submit a write and return an awaitable for its completion. The data is
+    // copied, so the caller's buffer can be reused right away.
+    WriteAwaiter asyncWrite(const void *data, size_t count)
+    {
+        int status = this->write(data, count);
+
+        return WriteAwaiter(this, this->getSubmitted(), status);
+    }
+
+    // Queue the data committed to the staging block, as FileWriter::flush()
+    // does, and return an awaitable for the completion of every write
+    // submitted so far. It resumes with -1 if the data cannot be queued.
+    WriteAwaiter flush()
+    {
+        int status = FileWriter<Engine>::flush();
+
+        return WriteAwaiter(this, this->getSubmitted(), status);
+    }
+
+    // Reap completions and resume the coroutines whose writes are done. If
+    // the writer fails, every waiting coroutine is resumed with -1. Returns
+    // the number of coroutines resumed.
+    int reap()
+    {
+        int resumed = 0;
+        int status = this->processQueue();
+        int64_t prefix = this->getCompletedPrefix();
+
+        while (!waiters.empty() &&
+               (status == -1 || waiters.front().target <= prefix)) {
+            coroutineWaiter waiter = waiters.front();
+
+            // The coroutine may wait again while it runs, which adds to the
+            // back of the queue, so it is removed before it is resumed.
+            waiters.pop_front();
+            *waiter.status = status;
+            waiter.handle.resume();
+            resumed++;
+        }
+
+        return resumed;
+    }
+
+    // Return the number of coroutines waiting for a write.
+    size_t waiting()
+    {
+        return waiters.size();
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+// The reflected Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+// Slicing-by-8 tables for the software version. They are built once on the
+// first call.
+static uint32_t crcTable[8][256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void crc32cInitTable()
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+
+        crcTable[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crcTable[0][n];
+
+        for (int k = 1; k < 8; k++) {
+            crc = crcTable[0][crc & 0xff] ^ (crc >> 8);
+            crcTable[k][n] = crc;
+        }
+    }
+}
+
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *p,
+                               size_t len)
+{
+    pthread_once(&crcTableOnce, crc32cInitTable);
+
+    while (len >= 8) {
+        uint64_t word;
+
+        // The memcpy() avoids unaligned access and compiles to a single load.
+        memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crcTable[7][word & 0xff] ^
+              crcTable[6][(word >> 8) & 0xff] ^
+              crcTable[5][(word >> 16) & 0xff] ^
+              crcTable[4][(word >> 24) & 0xff] ^
+              crcTable[3][(word >> 32) & 0xff] ^
+              crcTable[2][(word >> 40) & 0xff] ^
+              crcTable[1][(word >> 48) & 0xff] ^
+              crcTable[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+// The SSE 4.2 version is compiled for that target only, so the rest of the
+// program does not require it. It is picked at run time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *p,
+                               size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *p,
+                               size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    crc = ~crc;
+#if defined(CRC32C_X86)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+
+    if (hardware) {
+        crc = crc32cHardware(crc, p, len);
+    } else {
+        crc = crc32cSoftware(crc, p, len);
+    }
+#elif defined(CRC32C_ARM)
+    crc = crc32cHardware(crc, p, len);
+#else
+    crc = crc32cSoftware(crc, p, len);
+#endif
+
+    return ~crc;
+}
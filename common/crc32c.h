@@ -0,0 +1,13 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <cstddef>
+#include <stdint.h>
+
+// Compute the CRC32C (Castagnoli) checksum of a block of data. The crc
+// argument is the value returned by a previous call so that a checksum can be
+// computed over several blocks. Start with 0. The hardware CRC32 instruction
+// is used when the CPU supports it, otherwise a table driven version is used.
+uint32_t crc32c(uint32_t, const void *, size_t);
+
+#endif
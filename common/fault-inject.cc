@@ -0,0 +1,309 @@
+// An LD_PRELOAD shim that injects I/O faults into the writers, for the stress
+// benchmark. It wraps aio_write(), aio_error(), aio_return() and pwrite(),
+// and is set up with environment variables:
+//
+//   FAULT_EAGAIN   The probability that aio_write() fails with EAGAIN.
+//   FAULT_SHORT    The probability that a write completes short, with half
+//                  of its bytes.
+//   FAULT_ENOSPC   The probability that a write fails with ENOSPC.
+//   FAULT_DELAY    Microseconds added to every write before it completes.
+//   FAULT_SEED     The random seed, for repeatable runs.
+//
+// Short AIO writes are reported by aio_return() after the whole request was
+// written, so a resubmission writes the same bytes again. Programs can turn
+// the faults off and on with fault_inject_enable(), found with dlsym().
+//
+// It only builds on Linux, where RTLD_NEXT finds the real functions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <aio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+// The number of AIO requests with a fault or a delay tracked at once. When
+// the table is full, requests go through untouched.
+#define FAULT_TABLE_SZ      8192
+
+#define FAULT_NONE          0
+#define FAULT_SHORT_WRITE   1
+#define FAULT_NO_SPACE      2
+
+typedef struct faultEntry {
+    const struct aiocb  *request;
+    // When the request may be reported as done, in seconds.
+    double              ready;
+    int                 fault;
+} faultEntry;
+
+typedef int (*aioWriteFunction)(struct aiocb *);
+typedef int (*aioErrorFunction)(const struct aiocb *);
+typedef ssize_t (*aioReturnFunction)(struct aiocb *);
+typedef ssize_t (*pwriteFunction)(int, const void *, size_t, off_t);
+
+static aioWriteFunction realAioWrite;
+static aioErrorFunction realAioError;
+static aioReturnFunction realAioReturn;
+static pwriteFunction realPwrite;
+
+static double eagainRate;
+static double shortRate;
+static double enospcRate;
+static long delay;
+static unsigned long seed;
+static volatile int enabled = 1;
+
+static faultEntry table[FAULT_TABLE_SZ];
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+static double envRate(const char *name)
+{
+    const char *value = getenv(name);
+
+    return value != NULL ? strtod(value, (char **)NULL) : 0;
+}
+
+static void init()
+{
+    const char *value;
+
+    realAioWrite = (aioWriteFunction)dlsym(RTLD_NEXT, "aio_write");
+    realAioError = (aioErrorFunction)dlsym(RTLD_NEXT, "aio_error");
+    realAioReturn = (aioReturnFunction)dlsym(RTLD_NEXT, "aio_return");
+    realPwrite = (pwriteFunction)dlsym(RTLD_NEXT, "pwrite");
+    eagainRate = envRate("FAULT_EAGAIN");
+    shortRate = envRate("FAULT_SHORT");
+    enospcRate = envRate("FAULT_ENOSPC");
+    delay = (long)envRate("FAULT_DELAY");
+    value = getenv("FAULT_SEED");
+    seed = value != NULL ? strtoul(value, (char **)NULL, 10) :
+                           (unsigned long)time(NULL);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Return true with the given probability. Every thread has its own
+// generator, seeded from FAULT_SEED and the order threads first get here.
+static bool chance(double rate)
+{
+    static __thread uint64_t state;
+    static uint64_t threads;
+
+    if (rate <= 0 || !enabled) {
+        return false;
+    }
+
+    if (state == 0) {
+        state = (seed + __sync_add_and_fetch(&threads, 1)) *
+                0x9E3779B97F4A7C15ULL | 1;
+    }
+
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (double)((state * 0x2545F4914F6CDD1DULL) >> 11) /
+           (double)(1ULL << 53) < rate;
+}
+
+static unsigned int slot(const struct aiocb *request)
+{
+    return (unsigned int)(((uintptr_t)request >> 4) % FAULT_TABLE_SZ);
+}
+
+// Remember the fault and delay of a request. Must be called with tableLock
+// held.
+static void track(const struct aiocb *request, int fault)
+{
+    unsigned int s = slot(request);
+
+    for (int probe = 0; probe < FAULT_TABLE_SZ; probe++) {
+        faultEntry *entry = &table[(s + probe) % FAULT_TABLE_SZ];
+
+        if (entry->request == NULL || entry->request == request) {
+            entry->request = request;
+            entry->ready = now() + delay / 1e6;
+            entry->fault = fault;
+            return;
+        }
+    }
+}
+
+// Find a tracked request. Must be called with tableLock held.
+static faultEntry *find(const struct aiocb *request)
+{
+    unsigned int s = slot(request);
+
+    for (int probe = 0; probe < FAULT_TABLE_SZ; probe++) {
+        faultEntry *entry = &table[(s + probe) % FAULT_TABLE_SZ];
+
+        if (entry->request == request) {
+            return entry;
+        }
+
+        if (entry->request == NULL) {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+// Remove a tracked request, moving later entries of its probe run back so
+// lookups still find them. Must be called with tableLock held.
+static void untrack(faultEntry *entry)
+{
+    unsigned int hole = entry - table;
+    unsigned int next = (hole + 1) % FAULT_TABLE_SZ;
+
+    entry->request = NULL;
+
+    while (table[next].request != NULL) {
+        unsigned int home = slot(table[next].request);
+
+        // Move the entry into the hole unless its home slot lies between
+        // the hole and where it is now.
+        if ((next > hole && (home <= hole || home > next)) ||
+            (next < hole && (home <= hole && home > next))) {
+            table[hole] = table[next];
+            table[next].request = NULL;
+            hole = next;
+        }
+
+        next = (next + 1) % FAULT_TABLE_SZ;
+    }
+}
+
+extern "C" {
+
+// Turn the faults off with 0 and back on with 1.
+void fault_inject_enable(int value)
+{
+    enabled = value;
+}
+
+int aio_write(struct aiocb *request)
+{
+    pthread_once(&initOnce, init);
+
+    if (chance(eagainRate)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int fault = FAULT_NONE;
+
+    if (chance(enospcRate)) {
+        fault = FAULT_NO_SPACE;
+    } else if (request->aio_nbytes > 1 && chance(shortRate)) {
+        fault = FAULT_SHORT_WRITE;
+    }
+
+    // Track the request before it is issued, so it cannot complete first.
+    bool tracked = fault != FAULT_NONE || (delay > 0 && enabled);
+
+    if (tracked) {
+        pthread_mutex_lock(&tableLock);
+        track(request, fault);
+        pthread_mutex_unlock(&tableLock);
+    }
+
+    int ret = realAioWrite(request);
+
+    if (ret == -1 && tracked) {
+        pthread_mutex_lock(&tableLock);
+        faultEntry *entry = find(request);
+
+        if (entry != NULL) {
+            untrack(entry);
+        }
+
+        pthread_mutex_unlock(&tableLock);
+    }
+
+    return ret;
+}
+
+int aio_error(const struct aiocb *request)
+{
+    pthread_once(&initOnce, init);
+
+    int ret = realAioError(request);
+
+    if (ret == EINPROGRESS) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&tableLock);
+    faultEntry *entry = find(request);
+
+    if (entry != NULL) {
+        if (now() < entry->ready) {
+            ret = EINPROGRESS;
+        } else if (ret == 0 && entry->fault == FAULT_NO_SPACE) {
+            ret = ENOSPC;
+        }
+    }
+
+    pthread_mutex_unlock(&tableLock);
+    return ret;
+}
+
+ssize_t aio_return(struct aiocb *request)
+{
+    pthread_once(&initOnce, init);
+
+    ssize_t ret = realAioReturn(request);
+
+    pthread_mutex_lock(&tableLock);
+    faultEntry *entry = find(request);
+
+    if (entry != NULL) {
+        if (ret > 0 && entry->fault == FAULT_NO_SPACE) {
+            errno = ENOSPC;
+            ret = -1;
+        } else if (ret > 1 && entry->fault == FAULT_SHORT_WRITE) {
+            ret /= 2;
+        }
+
+        untrack(entry);
+    }
+
+    pthread_mutex_unlock(&tableLock);
+    return ret;
+}
+
+ssize_t pwrite(int fd, const void *data, size_t count, off_t offset)
+{
+    pthread_once(&initOnce, init);
+
+    if (delay > 0 && enabled) {
+        usleep(delay);
+    }
+
+    if (chance(enospcRate)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (count > 1 && chance(shortRate)) {
+        count /= 2;
+    }
+
+    return realPwrite(fd, data, count, offset);
+}
+
+}
@@ -0,0 +1,335 @@
+#ifndef _FileWriter_H
+#define _FileWriter_H
+
+// The backend is picked at build time by the include path. Both the aio and
+// pthreads directories provide an AsyncFileWriter class with the same API, so
+// building with -I../aio or -I../pthreads and linking the matching objects is
+// all it takes to switch between them.
+#include "async-file-writer.h"
+#include "mapped-file-writer.h"
+#include <future>
+
+// An engine policy says which writer class FileWriter uses and how to set it
+// up. The policies are plain structs with static methods, so nothing is
+// virtual and every FileWriter call can be inlined into the caller.
+
+// Queue writes through the backend, POSIX AIO or the writer thread.
+struct AsyncEngine {
+    typedef AsyncFileWriter Writer;
+
+    static const char *name()
+    {
+        return "async";
+    }
+
+    static void configure(Writer *)
+    {
+    }
+};
+
+// Write on the caller's thread with pwrite().
+struct SyncEngine {
+    typedef AsyncFileWriter Writer;
+
+    static const char *name()
+    {
+        return "sync";
+    }
+
+    static void configure(Writer *writer)
+    {
+        writer->setSynchronous(true);
+    }
+};
+
+// Queue writes, but write a small one directly when the queue is empty and
+// that has been faster. See AsyncFileWriter::setAdaptiveDispatch().
+struct AdaptiveEngine {
+    typedef AsyncFileWriter Writer;
+
+    static const char *name()
+    {
+        return "adaptive";
+    }
+
+    static void configure(Writer *writer)
+    {
+        writer->setAdaptiveDispatch(true);
+    }
+};
+
+// Copy writes into a shared mapping of the file, with no syscall per write.
+// It suits streams of small records. See MappedFileWriter.
+struct MappedEngine {
+    typedef MappedFileWriter Writer;
+
+    static const char *name()
+    {
+        return "mapped";
+    }
+
+    static void configure(Writer *)
+    {
+    }
+};
+
+template <class Engine>
+class FileWriter {
+private:
+    typename Engine::Writer writer;
+
+    // The completion callback behind writeFuture(). It owns the promise.
+    static void fulfill(void *context, int status, size_t count)
+    {
+        std::promise<ssize_t> *promise = (std::promise<ssize_t> *)context;
+
+        promise->set_value(status == -1 ? -1 : (ssize_t)count);
+        delete promise;
+    }
+
+public:
+    FileWriter(const char *filename) : writer(filename)
+    {
+        Engine::configure(&writer);
+    }
+
+    // The engine's writer, for settings only one engine has.
+    typename Engine::Writer &engine()
+    {
+        return writer;
+    }
+
+    static const char *engineName()
+    {
+        return Engine::name();
+    }
+
+    int openFile()
+    {
+        return writer.openFile();
+    }
+
+    int closeFile()
+    {
+        return writer.closeFile();
+    }
+
+    int syncFile()
+    {
+        return writer.syncFile();
+    }
+
+    int closeFileAsync(fileCallback callback, void *context)
+    {
+        return writer.closeFileAsync(callback, context);
+    }
+
+    int syncFileAsync(fileCallback callback, void *context)
+    {
+        return writer.syncFileAsync(callback, context);
+    }
+
+    int unlinkFile(fileCallback callback, void *context)
+    {
+        return writer.unlinkFile(callback, context);
+    }
+
+    int renameFile(const char *newName, fileCallback callback, void *context)
+    {
+        return writer.renameFile(newName, callback, context);
+    }
+
+    int write(const void *data, size_t count)
+    {
+        return writer.write(data, count);
+    }
+
+    int write(const void *data, size_t count, writeCallback callback,
+              void *context)
+    {
+        return writer.write(data, count, callback, context);
+    }
+
+    int writeNoCopy(const void *data, size_t count)
+    {
+        return writer.writeNoCopy(data, count);
+    }
+
+    int writeNoCopy(const void *data, size_t count, writeCallback callback,
+                    void *context)
+    {
+        return writer.writeNoCopy(data, count, callback, context);
+    }
+
+    // Write the buffers of an iovec array as one record, without
+    // concatenating them first.
+    int writev(const struct iovec *iov, int iovcnt)
+    {
+        return writer.writev(iov, iovcnt);
+    }
+
+    int writev(const struct iovec *iov, int iovcnt, writeCallback callback,
+               void *context)
+    {
+        return writer.writev(iov, iovcnt, callback, context);
+    }
+
+    // Submit a write and return a future for it. It holds the number of
+    // bytes written once the write completes, or -1 if it failed or was
+    // canceled. With the AIO backend the future is only fulfilled by
+    // processQueue(), so do not wait on it without processing the queue.
+    std::future<ssize_t> writeFuture(const void *data, size_t count)
+    {
+        std::promise<ssize_t> *promise = new std::promise<ssize_t>();
+        std::future<ssize_t> future = promise->get_future();
+        int64_t submitted = writer.getSubmitted();
+
+        // A write can fail after it was queued, for example when the queue
+        // processing that follows it fails. Its callback still runs then, so
+        // the promise is only dropped here if nothing was queued.
+        if (writer.write(data, count, &FileWriter::fulfill, promise) == -1 &&
+            writer.getSubmitted() == submitted) {
+            promise->set_value(-1);
+            delete promise;
+        }
+
+        return future;
+    }
+
+    int writeAt(off_t position, const void *data, size_t count)
+    {
+        return writer.writeAt(position, data, count);
+    }
+
+    int writeAt(off_t position, const void *data, size_t count,
+                writeCallback callback, void *context)
+    {
+        return writer.writeAt(position, data, count, callback, context);
+    }
+
+    int writeHole(size_t count)
+    {
+        return writer.writeHole(count);
+    }
+
+    void *reserve(size_t count)
+    {
+        return writer.reserve(count);
+    }
+
+    int commit(size_t count)
+    {
+        return writer.commit(count);
+    }
+
+    int flush()
+    {
+        return writer.flush();
+    }
+
+    int processQueue()
+    {
+        return writer.processQueue();
+    }
+
+    bool pendingWrites()
+    {
+        return writer.pendingWrites();
+    }
+
+    int64_t getSubmitted()
+    {
+        return writer.getSubmitted();
+    }
+
+    int64_t getCompleted()
+    {
+        return writer.getCompleted();
+    }
+
+    int64_t getCompletedPrefix()
+    {
+        return writer.getCompletedPrefix();
+    }
+
+    int getCompletionFd()
+    {
+        return writer.getCompletionFd();
+    }
+
+    void clearCompletionFd()
+    {
+        writer.clearCompletionFd();
+    }
+
+    int64_t queueSize()
+    {
+        return writer.queueSize();
+    }
+
+    bool getWriteError()
+    {
+        return writer.getWriteError();
+    }
+
+    void cancelWrites()
+    {
+        writer.cancelWrites();
+    }
+
+    int cancelWrites(long timeout, bool keepCompleted)
+    {
+        return writer.cancelWrites(timeout, keepCompleted);
+    }
+
+    void setBufferArena(BufferArena *arena)
+    {
+        writer.setBufferArena(arena);
+    }
+
+    void setDirectIO(bool value)
+    {
+        writer.setDirectIO(value);
+    }
+
+    int setSyncBufferSize(size_t size)
+    {
+        return writer.setSyncBufferSize(size);
+    }
+
+    int setWritePriority(int value)
+    {
+        return writer.setWritePriority(value);
+    }
+
+    int setIOPriority(int ioclass, int level)
+    {
+        return writer.setIOPriority(ioclass, level);
+    }
+
+    int setCpuAffinity(const int *cpus, int count)
+    {
+        return writer.setCpuAffinity(cpus, count);
+    }
+
+    int setThreadScheduling(int policy, int priority)
+    {
+        return writer.setThreadScheduling(policy, priority);
+    }
+
+    int setNumaNode(int node)
+    {
+        return writer.setNumaNode(node);
+    }
+};
+
+// The engine used by programs that do not pick one themselves. Build with
+// -DFILE_WRITER_ENGINE=SyncEngine, AdaptiveEngine or MappedEngine to change
+// it.
+#ifndef FILE_WRITER_ENGINE
+#define FILE_WRITER_ENGINE AsyncEngine
+#endif
+
+typedef FileWriter<FILE_WRITER_ENGINE> DefaultFileWriter;
+
+#endif
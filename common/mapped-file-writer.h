@@ -0,0 +1,569 @@
+#ifndef _MappedFileWriter_H
+#define _MappedFileWriter_H
+
+// The callback types and BufferArena come from the backend, so the mapped
+// writer can stand in for it behind FileWriter.
+#include "async-file-writer.h"
+#include <stdio.h>
+#include <sys/mman.h>
+
+// The size of the window of the file that is mapped at a time, and the
+// chunks the file is grown in. Both are multiples of any page size.
+#define MAPPED_WINDOW_SZ    (4 * 1024 * 1024)
+#define MAPPED_GROW_SZ      (64 * 1024 * 1024)
+
+// A writer that copies records into a shared mapping of the file instead of
+// making a syscall or queueing a buffer for each one. The file is grown ahead
+// of the data in large chunks, and a window of it is mapped at a time. When
+// the data moves past a window, writeback of its dirty pages is started and
+// it is unmapped. Closing the file trims it to the data written.
+//
+// Every write is complete when it returns, so processQueue() and the
+// completion counts are there for the FileWriter API only. There are no
+// threads, so the thread settings are accepted and ignored, and the file
+// operations run on the caller's thread before their callback is called.
+//
+// Where fallocate() is supported, the chunks are allocated on disk when the
+// file grows, so a full disk fails the write. On other file systems it shows
+// up as SIGBUS when the page is written, as with any mapped file.
+class MappedFileWriter {
+private:
+    const char          *filename;
+    int                 fd;
+    // The end of the data written so far, where the next write goes.
+    off_t               offset;
+    // The end of the furthest write made with writeAt().
+    off_t               positionalEnd;
+    // The size the file was grown to.
+    off_t               fileSize;
+    // The mapped window, the file offset it starts at and its length.
+    unsigned char       *window;
+    off_t               windowStart;
+    size_t              windowLength;
+    size_t              pageSize;
+    int64_t             submitted;
+    bool                writeError;
+    bool                closeCalled;
+
+    // Start writeback of the data written to the window and unmap it.
+    int releaseWindow()
+    {
+        int ret = 0;
+
+        if (window == NULL) {
+            return 0;
+        }
+
+        off_t dirty = offset - windowStart;
+
+        if (dirty > (off_t)windowLength) {
+            dirty = windowLength;
+        }
+
+        if (dirty > 0) {
+#ifdef __linux__
+            if (sync_file_range(fd, windowStart, dirty,
+                                SYNC_FILE_RANGE_WRITE) == -1) {
+                ret = -1;
+            }
+#else
+            if (msync(window, dirty, MS_ASYNC) == -1) {
+                ret = -1;
+            }
+#endif
+        }
+
+        if (munmap(window, windowLength) == -1) {
+            ret = -1;
+        }
+
+        window = NULL;
+        return ret;
+    }
+
+    // Grow the file in whole chunks until it holds length bytes. Only the
+    // chunks from the one holding start on are allocated, so a hole left
+    // before them by writeHole() or writeAt() stays sparse.
+    int growFile(off_t start, off_t length)
+    {
+        if (length <= fileSize) {
+            return 0;
+        }
+
+        off_t size = (length + MAPPED_GROW_SZ - 1) / MAPPED_GROW_SZ *
+                     MAPPED_GROW_SZ;
+
+#ifdef __linux__
+        off_t from = start / MAPPED_GROW_SZ * MAPPED_GROW_SZ;
+
+        if (from < fileSize) {
+            from = fileSize;
+        }
+
+        // Allocating the blocks up front turns a full disk into an error
+        // here instead of SIGBUS later. Allocating past the end extends the
+        // file over the hole. File systems without fallocate() fall back to
+        // a sparse file.
+        if (fallocate(fd, 0, from, size - from) == 0) {
+            fileSize = size;
+            return 0;
+        }
+
+        if (errno != EOPNOTSUPP) {
+            return -1;
+        }
+#endif
+
+        if (ftruncate(fd, size) == -1) {
+            return -1;
+        }
+
+        fileSize = size;
+        return 0;
+    }
+
+    // Make sure count bytes at position are mapped. The window starts at the
+    // page holding position and is at least MAPPED_WINDOW_SZ long.
+    int mapWindow(off_t position, size_t count)
+    {
+        if (window != NULL && position >= windowStart &&
+            position + (off_t)count <= windowStart + (off_t)windowLength) {
+            return 0;
+        }
+
+        if (releaseWindow() == -1) {
+            writeError = true;
+            return -1;
+        }
+
+        off_t start = position / pageSize * pageSize;
+        size_t length = (position - start + count + pageSize - 1) /
+                        pageSize * pageSize;
+
+        if (length < MAPPED_WINDOW_SZ) {
+            length = MAPPED_WINDOW_SZ;
+        }
+
+        if (growFile(start, start + length) == -1) {
+            writeError = true;
+            return -1;
+        }
+
+        void *addr = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+                          start);
+
+        if (addr == MAP_FAILED) {
+            writeError = true;
+            return -1;
+        }
+
+        window = (unsigned char *)addr;
+        windowStart = start;
+        windowLength = length;
+        return 0;
+    }
+
+    // Copy count bytes to position, a window at a time.
+    int copyOut(off_t position, const void *data, size_t count)
+    {
+        const unsigned char *source = (const unsigned char *)data;
+
+        while (count > 0) {
+            size_t chunk = count < MAPPED_WINDOW_SZ ? count : MAPPED_WINDOW_SZ;
+
+            if (mapWindow(position, chunk) == -1) {
+                return -1;
+            }
+
+            off_t end = windowStart + windowLength;
+
+            if ((off_t)count < end - position) {
+                chunk = count;
+            } else {
+                chunk = end - position;
+            }
+
+            memcpy(window + (position - windowStart), source, chunk);
+            position += chunk;
+            source += chunk;
+            count -= chunk;
+        }
+
+        return 0;
+    }
+
+    // Report a file operation that ran on the caller's thread to its
+    // callback.
+    static int finishOperation(int ret, fileCallback callback, void *context)
+    {
+        if (callback != NULL) {
+            callback(context, ret == -1 ? errno : 0);
+        }
+
+        return 0;
+    }
+
+public:
+    MappedFileWriter(const char *filename) : filename(filename)
+    {
+        fd = -1;
+        offset = 0;
+        positionalEnd = 0;
+        fileSize = 0;
+        window = NULL;
+        windowStart = 0;
+        windowLength = 0;
+        long page_size = sysconf(_SC_PAGESIZE);
+        pageSize = page_size > 0 ? (size_t)page_size : 4096;
+        submitted = WRITE_COUNT_START;
+        writeError = false;
+        closeCalled = false;
+    }
+
+    ~MappedFileWriter()
+    {
+        closeFile();
+    }
+
+    // The file is mapped for writing, so it has to be opened read and write.
+    int openFile()
+    {
+        if (fd != -1) {
+            return fd;
+        }
+
+        fd = open(filename, O_RDWR|O_CREAT|O_TRUNC,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        return fd;
+    }
+
+    // Unmap the window, trim the file to the data and close it.
+    int closeFile()
+    {
+        int ret = 0;
+
+        if (closeCalled || fd == -1) {
+            return 0;
+        }
+
+        closeCalled = true;
+
+        if (releaseWindow() == -1) {
+            ret = -1;
+        }
+
+        off_t length = offset > positionalEnd ? offset : positionalEnd;
+
+        if (fileSize != length && ftruncate(fd, length) == -1) {
+            ret = -1;
+        }
+
+        if (close(fd) == -1) {
+            ret = -1;
+        }
+
+        fd = -1;
+        return ret;
+    }
+
+    int syncFile()
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (window != NULL && msync(window, windowLength, MS_SYNC) == -1) {
+            return -1;
+        }
+
+        return fsync(fd);
+    }
+
+    int closeFileAsync(fileCallback callback, void *context)
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        return finishOperation(closeFile(), callback, context);
+    }
+
+    int syncFileAsync(fileCallback callback, void *context)
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        return finishOperation(syncFile(), callback, context);
+    }
+
+    int unlinkFile(fileCallback callback, void *context)
+    {
+        return finishOperation(unlink(filename), callback, context);
+    }
+
+    int renameFile(const char *new_name, fileCallback callback,
+                   void *context)
+    {
+        int ret = rename(filename, new_name);
+
+        if (ret == 0) {
+            filename = new_name;
+        }
+
+        return finishOperation(ret, callback, context);
+    }
+
+    int write(const void *data, size_t count)
+    {
+        return write(data, count, NULL, NULL);
+    }
+
+    int write(const void *data, size_t count, writeCallback callback,
+              void *context)
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (copyOut(offset, data, count) == -1) {
+            return -1;
+        }
+
+        offset += count;
+        submitted++;
+
+        if (callback != NULL) {
+            callback(context, 0, count);
+        }
+
+        return 0;
+    }
+
+    int writev(const struct iovec *iov, int iovcnt)
+    {
+        return writev(iov, iovcnt, NULL, NULL);
+    }
+
+    // Copy the buffers of an iovec array into the mapping one after the
+    // other, as one write.
+    int writev(const struct iovec *iov, int iovcnt, writeCallback callback,
+               void *context)
+    {
+        size_t count = 0;
+
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (iovcnt < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        for (int i = 0; i < iovcnt; i++) {
+            if (copyOut(offset + count, iov[i].iov_base,
+                        iov[i].iov_len) == -1) {
+                return -1;
+            }
+
+            count += iov[i].iov_len;
+        }
+
+        offset += count;
+        submitted++;
+
+        if (callback != NULL) {
+            callback(context, 0, count);
+        }
+
+        return 0;
+    }
+
+    // The data is always copied into the mapping, so these are the same as
+    // write().
+    int writeNoCopy(const void *data, size_t count)
+    {
+        return write(data, count, NULL, NULL);
+    }
+
+    int writeNoCopy(const void *data, size_t count, writeCallback callback,
+                    void *context)
+    {
+        return write(data, count, callback, context);
+    }
+
+    int writeAt(off_t position, const void *data, size_t count)
+    {
+        return writeAt(position, data, count, NULL, NULL);
+    }
+
+    int writeAt(off_t position, const void *data, size_t count,
+                writeCallback callback, void *context)
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (copyOut(position, data, count) == -1) {
+            return -1;
+        }
+
+        if (position + (off_t)count > positionalEnd) {
+            positionalEnd = position + count;
+        }
+
+        submitted++;
+
+        if (callback != NULL) {
+            callback(context, 0, count);
+        }
+
+        return 0;
+    }
+
+    // The file is grown ahead of the data, so a hole only moves the offset.
+    // Closing the file trims it to the offset, hole included.
+    int writeHole(size_t count)
+    {
+        offset += count;
+        return 0;
+    }
+
+    // Return a pointer to count bytes of the mapping at the end of the data,
+    // so a record can be serialized straight into the file. Call commit()
+    // with the bytes actually used.
+    void *reserve(size_t count)
+    {
+        if (fd == -1 || closeCalled) {
+            errno = EBADF;
+            return NULL;
+        }
+
+        if (mapWindow(offset, count) == -1) {
+            return NULL;
+        }
+
+        return window + (offset - windowStart);
+    }
+
+    int commit(size_t count)
+    {
+        if (window == NULL ||
+            offset + (off_t)count > windowStart + (off_t)windowLength) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        offset += count;
+        submitted++;
+        return 0;
+    }
+
+    int flush()
+    {
+        return 0;
+    }
+
+    int processQueue()
+    {
+        return writeError ? -1 : 0;
+    }
+
+    bool pendingWrites()
+    {
+        return false;
+    }
+
+    int64_t getSubmitted()
+    {
+        return submitted;
+    }
+
+    int64_t getCompleted()
+    {
+        return submitted;
+    }
+
+    int64_t getCompletedPrefix()
+    {
+        return submitted;
+    }
+
+    // There is nothing to wait for, so there is no completion fd.
+    int getCompletionFd()
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    void clearCompletionFd()
+    {
+    }
+
+    int64_t queueSize()
+    {
+        return 0;
+    }
+
+    bool getWriteError()
+    {
+        return writeError;
+    }
+
+    void cancelWrites()
+    {
+    }
+
+    int cancelWrites(long, bool)
+    {
+        return 0;
+    }
+
+    void setBufferArena(BufferArena *)
+    {
+    }
+
+    void setDirectIO(bool)
+    {
+    }
+
+    // Writes are already gathered in the mapping.
+    int setSyncBufferSize(size_t)
+    {
+        return 0;
+    }
+
+    int setWritePriority(int)
+    {
+        return 0;
+    }
+
+    int setIOPriority(int, int)
+    {
+        return 0;
+    }
+
+    int setCpuAffinity(const int *, int)
+    {
+        return 0;
+    }
+
+    int setThreadScheduling(int, int)
+    {
+        return 0;
+    }
+
+    int setNumaNode(int)
+    {
+        return 0;
+    }
+};
+
+#endif
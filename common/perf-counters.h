@@ -0,0 +1,190 @@
+#ifndef _PerfCounters_H
+#define _PerfCounters_H
+
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// The counters PerfCounters measures, in the order they are reported.
+#define PERF_CYCLES             0
+#define PERF_INSTRUCTIONS       1
+#define PERF_CACHE_MISSES       2
+#define PERF_CONTEXT_SWITCHES   3
+#define PERF_PAGE_FAULTS        4
+#define PERF_COUNTERS           5
+
+// Hardware and software event counters for the benchmarks, read with
+// perf_event_open(). The counters follow the threads the program starts
+// after they are opened, so open them before the writer does, and the
+// writer, open and AIO threads are counted along with the caller.
+//
+// A counter the kernel or the host does not allow, such as the hardware
+// counters in most virtual machines, is left out of the report. Kernel time
+// is only counted where perf_event_paranoid allows it. On other systems
+// nothing is counted.
+class PerfCounters {
+private:
+    int         fds[PERF_COUNTERS];
+    uint64_t    values[PERF_COUNTERS];
+    bool        kernel[PERF_COUNTERS];
+
+#ifdef __linux__
+    static int openCounter(uint32_t type, uint64_t config,
+                           bool exclude_kernel)
+    {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+        // The hardware counters can be multiplexed, so the times are read
+        // to scale the counts.
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+public:
+    PerfCounters()
+    {
+#ifdef __linux__
+        static const uint32_t types[PERF_COUNTERS] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+            PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE
+        };
+        static const uint64_t configs[PERF_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES,
+            PERF_COUNT_SW_PAGE_FAULTS
+        };
+#endif
+
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            fds[c] = -1;
+            values[c] = 0;
+            kernel[c] = false;
+#ifdef __linux__
+            // Try to count kernel time as well, which is where the
+            // syscalls of write() go, and fall back to user time.
+            if ((fds[c] = openCounter(types[c], configs[c], false)) != -1) {
+                kernel[c] = true;
+            } else {
+                fds[c] = openCounter(types[c], configs[c], true);
+            }
+#endif
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (fds[c] != -1) {
+                close(fds[c]);
+            }
+        }
+    }
+
+    // Return true if any counter could be opened.
+    bool available()
+    {
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (fds[c] != -1) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Reset the counters and start counting.
+    void start()
+    {
+#ifdef __linux__
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (fds[c] != -1) {
+                ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stop counting and read the counters.
+    void stop()
+    {
+#ifdef __linux__
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            uint64_t data[3];
+
+            if (fds[c] == -1) {
+                continue;
+            }
+
+            ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(fds[c], data, sizeof(data)) != sizeof(data) ||
+                data[2] == 0) {
+                values[c] = 0;
+                continue;
+            }
+
+            // Scale the count up to the whole time the counter was enabled
+            // if it had to share the hardware.
+            values[c] = data[2] < data[1] ?
+                (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+        }
+#endif
+    }
+
+    // Return a counter read by stop(), or -1 if it is not available.
+    int64_t get(int counter)
+    {
+        return fds[counter] != -1 ? (int64_t)values[counter] : -1;
+    }
+
+    // Print the counters divided by count, the writes they were measured
+    // over. User-only counters are marked with (u).
+    void report(std::ostream &out, int64_t count)
+    {
+        static const char *names[PERF_COUNTERS] = {
+            "Cycles:     ", "Instrs:     ", "LLC misses: ", "Ctx sw:     ",
+            "Faults:     "
+        };
+
+        if (count <= 0) {
+            return;
+        }
+
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (fds[c] == -1) {
+                continue;
+            }
+
+            out << names[c] << (double)values[c] / count << " per write"
+                << (kernel[c] ? "" : " (u)") << std::endl;
+        }
+
+        if (fds[PERF_CYCLES] != -1 && fds[PERF_INSTRUCTIONS] != -1 &&
+            values[PERF_CYCLES] > 0) {
+            out << "IPC:        "
+                << (double)values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]
+                << std::endl;
+        }
+    }
+};
+
+#endif
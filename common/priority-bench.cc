@@ -0,0 +1,154 @@
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include "file-writer.h"
+
+using namespace std;
+
+#define BULK_SZ     (1024 * 1024)
+
+void usage()
+{
+    cout << endl;
+    cout << "Usage: %s <bulk megabytes> <records>" << endl;
+    cout << endl;
+    cout << "Queues \"bulk megabytes\" of bulk writes to ./test-file.txt and then writes" << endl;
+    cout << "\"records\" short records one at a time behind them, once in the bulk lane" << endl;
+    cout << "and once in the normal lane, and reports how long the records took." << endl;
+    cout << endl;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The completion callback of a record. It only flags the record as done.
+void recordDone(void *context, int status, size_t)
+{
+    *(int *)context = status == -1 ? -1 : 1;
+}
+
+// Queue the bulk writes, then write the records in the given lane and print
+// the average and worst record latency. Returns -1 on failure.
+int run(const unsigned char *bulk, long megabytes, long records, int priority)
+{
+    DefaultFileWriter *fileWriter = new DefaultFileWriter("test-file.txt");
+    double total = 0;
+    double worst = 0;
+
+    if (fileWriter->openFile() == -1) {
+        perror("fileWriter.openFile()");
+        delete fileWriter;
+        return -1;
+    }
+
+    fileWriter->setWritePriority(WRITE_PRIORITY_BULK);
+
+    for (long m = 0; m < megabytes; m++) {
+        if (fileWriter->write(bulk, BULK_SZ) == -1) {
+            perror("fileWriter.write() error");
+            fileWriter->cancelWrites();
+            delete fileWriter;
+            return -1;
+        }
+    }
+
+    fileWriter->setWritePriority(priority);
+
+    for (long r = 0; r < records; r++) {
+        int done = 0;
+        double start = now();
+
+        if (fileWriter->write("audit record\n", 13, &recordDone, &done) == -1) {
+            perror("fileWriter.write() error");
+            fileWriter->cancelWrites();
+            delete fileWriter;
+            return -1;
+        }
+
+        // Wait for this record only. The bulk writes can still be queued.
+        while (done == 0) {
+            if (fileWriter->processQueue() == -1) {
+                perror("fileWriter.processQueue() error");
+                fileWriter->cancelWrites();
+                delete fileWriter;
+                return -1;
+            }
+
+            sched_yield();
+        }
+
+        double latency = now() - start;
+        total += latency;
+
+        if (latency > worst) {
+            worst = latency;
+        }
+    }
+
+    while (fileWriter->pendingWrites()) {
+        if (fileWriter->processQueue() == -1) {
+            perror("fileWriter.processQueue() error");
+            fileWriter->cancelWrites();
+            delete fileWriter;
+            return -1;
+        }
+
+        sched_yield();
+    }
+
+    if (fileWriter->closeFile() == -1) {
+        perror("fileWriter.closeFile()");
+        delete fileWriter;
+        return -1;
+    }
+
+    delete fileWriter;
+
+    cout << (priority == WRITE_PRIORITY_BULK ? "Bulk lane:  " : "Normal lane:")
+         << " average " << (records > 0 ? total / records * 1000 : 0)
+         << " ms, worst " << worst * 1000 << " ms" << endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        usage();
+        return -1;
+    }
+
+    long megabytes = strtol(argv[1], (char **)NULL, 10);
+    long records = strtol(argv[2], (char **)NULL, 10);
+
+    if (megabytes < 0 || records < 0) {
+        usage();
+        return -1;
+    }
+
+    unsigned char *bulk = (unsigned char *)malloc(BULK_SZ);
+
+    if (bulk == NULL) {
+        perror("malloc error");
+        return 1;
+    }
+
+    memset(bulk, 'b', BULK_SZ);
+    cout << "Backend:     " << ASYNC_FILE_WRITER_BACKEND << endl;
+    cout << "Bulk:        " << megabytes << " MiB" << endl;
+    cout << "Records:     " << records << endl;
+
+    if (run(bulk, megabytes, records, WRITE_PRIORITY_BULK) == -1 ||
+        run(bulk, megabytes, records, WRITE_PRIORITY_NORMAL) == -1) {
+        free(bulk);
+        return 1;
+    }
+
+    free(bulk);
+    return 0;
+}
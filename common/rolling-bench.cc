@@ -0,0 +1,128 @@
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include "rolling-file-writer.h"
+
+using namespace std;
+
+typedef RollingFileWriter<FILE_WRITER_ENGINE> DefaultRollingFileWriter;
+
+void usage()
+{
+    cout << endl;
+    cout << "Usage: %s <write count> <segment bytes>" << endl;
+    cout << endl;
+    cout << "Writes \"write count\" lines of \"Hello World\" to ./test-segment.000000," << endl;
+    cout << "./test-segment.000001 and so on, starting a new segment every \"segment" << endl;
+    cout << "bytes\", and reports the slowest write. The segments are checked and" << endl;
+    cout << "removed afterwards." << endl;
+    cout << endl;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Check every segment is within the size limit, remove them and return the
+// total size, or -1 if a segment is missing or too large.
+off_t checkSegments(int segments, off_t segment_bytes)
+{
+    off_t total = 0;
+    char filename[64];
+    struct stat st;
+
+    for (int s = 0; s < segments; s++) {
+        snprintf(filename, sizeof(filename), "test-segment.%06d", s);
+
+        if (stat(filename, &st) == -1 || st.st_size > segment_bytes) {
+            return -1;
+        }
+
+        total += st.st_size;
+        unlink(filename);
+    }
+
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        usage();
+        return -1;
+    }
+
+    long long count = strtoll(argv[1], (char **)NULL, 10);
+    off_t segment_bytes = (off_t)strtoll(argv[2], (char **)NULL, 10);
+
+    if (count < 0 || segment_bytes < 12) {
+        usage();
+        return -1;
+    }
+
+    DefaultRollingFileWriter *fileWriter =
+        new DefaultRollingFileWriter("test-segment", segment_bytes, 0);
+    double start = now();
+    double worst = 0;
+
+    if (fileWriter->openFile() == -1) {
+        perror("fileWriter.openFile()");
+        return 1;
+    }
+
+    for (long long t = 0; t < count; t++) {
+        double before = now();
+
+        if (fileWriter->write("Hello World\n", 12) == -1) {
+            perror("fileWriter.write() error");
+            delete fileWriter;
+            return 1;
+        }
+
+        double latency = now() - before;
+
+        if (latency > worst) {
+            worst = latency;
+        }
+    }
+
+    while (fileWriter->pendingWrites()) {
+        if (fileWriter->processQueue() == -1) {
+            perror("fileWriter.processQueue() error");
+            delete fileWriter;
+            return 1;
+        }
+
+        sched_yield();
+    }
+
+    int segments = fileWriter->getSegments();
+
+    if (fileWriter->closeFile() == -1) {
+        perror("fileWriter.closeFile()");
+        delete fileWriter;
+        return 1;
+    }
+
+    double elapsed = now() - start;
+    delete fileWriter;
+
+    cout << "Backend:    " << ASYNC_FILE_WRITER_BACKEND << endl;
+    cout << "Engine:     " << DefaultRollingFileWriter::engineName() << endl;
+    cout << "Segments:   " << segments << endl;
+    cout << "Total:      " << elapsed << " s" << endl;
+    cout << "Slowest:    " << worst * 1000 << " ms" << endl;
+
+    if (checkSegments(segments, segment_bytes) != (off_t)count * 12) {
+        cout << "Check:      FAILED" << endl;
+        return 1;
+    }
+
+    cout << "Check:      ok" << endl;
+    return 0;
+}
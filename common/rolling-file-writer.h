@@ -0,0 +1,321 @@
+#ifndef _RollingFileWriter_H
+#define _RollingFileWriter_H
+
+#include "file-writer.h"
+#include <stdio.h>
+#include <time.h>
+#include <deque>
+
+// A writer that rolls over to a new file, prefix.000000, prefix.000001 and
+// so on, once a segment reaches a size or age limit. The next segment is
+// always opened ahead of time on the writer's background open thread, so a
+// rotation only swaps pointers. The old segment is drained, synced and
+// closed by a retire thread instead of the writing thread.
+//
+// A write that does not fit in the current segment starts the next one, so
+// records are never split across files. Like FileWriter, it is meant to be
+// used from one thread.
+template <class Engine>
+class RollingFileWriter {
+private:
+    typedef struct rollingSegment {
+        FileWriter<Engine>  *writer;
+        // The writer keeps a pointer to its filename, so it lives as long
+        // as the writer.
+        char                *filename;
+        off_t               bytes;
+        // This flag indicates the segment was opened ahead of time but never
+        // written to, so it is removed instead of kept.
+        bool                unused;
+    } rollingSegment;
+
+    const char                  *prefix;
+    // The segment limits. A limit of 0 is no limit.
+    off_t                       maxBytes;
+    double                      maxSeconds;
+    int                         sequence;
+    int                         segments;
+    double                      segmentStart;
+    rollingSegment              current;
+    rollingSegment              next;
+    bool                        nextReady;
+    bool                        opened;
+    bool                        closeCalled;
+
+    // The segments waiting for the retire thread.
+    std::deque<rollingSegment>  retired;
+    pthread_mutex_t             retireLock;
+    pthread_cond_t              retireCond;
+    pthread_t                   retireTid;
+    bool                        retireStarted;
+    bool                        stopping;
+    bool                        retireError;
+
+    static double now()
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // Create the writer for the next segment and start opening it.
+    int openSegment(rollingSegment *segment)
+    {
+        size_t length = strlen(prefix) + 16;
+
+        if ((segment->filename = (char *)malloc(length)) == NULL) {
+            return -1;
+        }
+
+        snprintf(segment->filename, length, "%s.%06d", prefix, sequence);
+        segment->writer = new FileWriter<Engine>(segment->filename);
+        segment->bytes = 0;
+        segment->unused = true;
+
+        if (segment->writer->openFile() == -1) {
+            delete segment->writer;
+            free(segment->filename);
+            return -1;
+        }
+
+        sequence++;
+        return 0;
+    }
+
+    void retire(rollingSegment segment)
+    {
+        pthread_mutex_lock(&retireLock);
+        retired.push_back(segment);
+        pthread_cond_signal(&retireCond);
+        pthread_mutex_unlock(&retireLock);
+    }
+
+    // Switch to the segment opened ahead of time and start opening the one
+    // after it. If that open cannot be started, it is tried again at the
+    // next rotation.
+    int rotate()
+    {
+        if (!nextReady) {
+            if (openSegment(&next) == -1) {
+                return -1;
+            }
+
+            nextReady = true;
+        }
+
+        retire(current);
+        current = next;
+        segments++;
+        segmentStart = now();
+        nextReady = openSegment(&next) == 0;
+        return 0;
+    }
+
+    bool needsRotation(size_t count)
+    {
+        if (current.bytes == 0) {
+            return false;
+        }
+
+        return (maxBytes > 0 && current.bytes + (off_t)count > maxBytes) ||
+               (maxSeconds > 0 && now() - segmentStart >= maxSeconds);
+    }
+
+    // Wait for the writes of a retired segment, sync and close it. This runs
+    // on the retire thread, which is the only user of the writer by now.
+    void finishSegment(rollingSegment segment)
+    {
+        bool failed = false;
+
+        while (segment.writer->pendingWrites()) {
+            if (segment.writer->processQueue() == -1) {
+                failed = true;
+                break;
+            }
+
+            usleep(1000);
+        }
+
+        if (failed) {
+            segment.writer->cancelWrites();
+        } else if (!segment.unused && segment.writer->syncFile() == -1) {
+            failed = true;
+        }
+
+        if (segment.writer->closeFile() == -1) {
+            failed = true;
+        }
+
+        if (segment.unused) {
+            unlink(segment.filename);
+        }
+
+        delete segment.writer;
+        free(segment.filename);
+
+        if (failed) {
+            pthread_mutex_lock(&retireLock);
+            retireError = true;
+            pthread_mutex_unlock(&retireLock);
+        }
+    }
+
+    static void *retireHelper(void *context)
+    {
+        ((RollingFileWriter *)context)->retireSegments();
+        return (void *)0;
+    }
+
+    void retireSegments()
+    {
+        while (true) {
+            pthread_mutex_lock(&retireLock);
+
+            while (retired.empty() && !stopping) {
+                pthread_cond_wait(&retireCond, &retireLock);
+            }
+
+            if (retired.empty()) {
+                pthread_mutex_unlock(&retireLock);
+                break;
+            }
+
+            rollingSegment segment = retired.front();
+            retired.pop_front();
+            pthread_mutex_unlock(&retireLock);
+            finishSegment(segment);
+        }
+    }
+
+public:
+    RollingFileWriter(const char *prefix, off_t maxBytes, double maxSeconds)
+        : prefix(prefix), maxBytes(maxBytes), maxSeconds(maxSeconds)
+    {
+        sequence = 0;
+        segments = 0;
+        segmentStart = 0;
+        nextReady = false;
+        opened = false;
+        closeCalled = false;
+        retireStarted = false;
+        stopping = false;
+        retireError = false;
+        pthread_mutex_init(&retireLock, NULL);
+        pthread_cond_init(&retireCond, NULL);
+    }
+
+    ~RollingFileWriter()
+    {
+        closeFile();
+        pthread_cond_destroy(&retireCond);
+        pthread_mutex_destroy(&retireLock);
+    }
+
+    static const char *engineName()
+    {
+        return Engine::name();
+    }
+
+    // Open the first segment and start opening the second one.
+    int openFile()
+    {
+        if (opened) {
+            return 0;
+        }
+
+        if (openSegment(&current) == -1) {
+            return -1;
+        }
+
+        if (pthread_create(&retireTid, NULL,
+                           &RollingFileWriter::retireHelper, this) != 0) {
+            delete current.writer;
+            free(current.filename);
+            return -1;
+        }
+
+        retireStarted = true;
+        opened = true;
+        segments = 1;
+        segmentStart = now();
+        nextReady = openSegment(&next) == 0;
+        return 0;
+    }
+
+    int write(const void *data, size_t count)
+    {
+        if (!opened || closeCalled) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (needsRotation(count) && rotate() == -1) {
+            return -1;
+        }
+
+        if (current.writer->write(data, count) == -1) {
+            return -1;
+        }
+
+        current.bytes += count;
+        current.unused = false;
+        return 0;
+    }
+
+    int processQueue()
+    {
+        return opened ? current.writer->processQueue() : 0;
+    }
+
+    // Return true while the current segment has writes in progress. Retired
+    // segments are finished by the retire thread, and closeFile() waits for
+    // them.
+    bool pendingWrites()
+    {
+        return opened && current.writer->pendingWrites();
+    }
+
+    // Return the name of the segment being written.
+    const char *getFilename()
+    {
+        return opened ? current.filename : NULL;
+    }
+
+    // Return the number of segments started so far.
+    int getSegments()
+    {
+        return segments;
+    }
+
+    // Retire the current segment and wait until every segment is synced and
+    // closed. Returns -1 if any segment failed.
+    int closeFile()
+    {
+        if (!opened || closeCalled) {
+            return 0;
+        }
+
+        closeCalled = true;
+        retire(current);
+
+        if (nextReady) {
+            retire(next);
+            nextReady = false;
+        }
+
+        pthread_mutex_lock(&retireLock);
+        stopping = true;
+        pthread_cond_signal(&retireCond);
+        pthread_mutex_unlock(&retireLock);
+
+        if (retireStarted) {
+            pthread_join(retireTid, NULL);
+            retireStarted = false;
+        }
+
+        return retireError ? -1 : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include "file-writer.h"
+
+using namespace std;
+
+// The fault-inject.so switch, if the shim is preloaded.
+typedef void (*enableFunction)(int);
+
+void usage()
+{
+    cout << endl;
+    cout << "Usage: %s <write count> <record size>" << endl;
+    cout << endl;
+    cout << "Writes \"write count\" records of \"record size\" bytes to ./test-file.txt." << endl;
+    cout << "Run it with LD_PRELOAD=./fault-inject.so and the FAULT_* variables to" << endl;
+    cout << "inject faults. They are on for the first half of the writes and off for" << endl;
+    cout << "the second half. It reports the rate of both halves, the time taken to" << endl;
+    cout << "finish the first half once the faults stopped, and the failed writes." << endl;
+    cout << endl;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The completion callback of every write. It counts the failed ones.
+void writeDone(void *context, int status, size_t)
+{
+    if (status == -1) {
+        (*(long long *)context)++;
+    }
+}
+
+// The byte at a file offset. Every record is cut from this pattern, so the
+// file can be checked without keeping the records.
+unsigned char patternAt(off_t position)
+{
+    return 'a' + position % 26;
+}
+
+bool checkFile(const char *filename, off_t length)
+{
+    FILE *file = fopen(filename, "rb");
+    off_t position = 0;
+    int c;
+
+    if (file == NULL) {
+        return false;
+    }
+
+    while ((c = fgetc(file)) != EOF) {
+        if (position >= length || c != patternAt(position)) {
+            fclose(file);
+            return false;
+        }
+
+        position++;
+    }
+
+    fclose(file);
+    return position == length;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        usage();
+        return -1;
+    }
+
+    long long count = strtoll(argv[1], (char **)NULL, 10);
+    size_t record_size = (size_t)strtoll(argv[2], (char **)NULL, 10);
+
+    if (count < 2 || record_size == 0) {
+        usage();
+        return -1;
+    }
+
+    // The records start at every offset of the pattern, so it is made 26
+    // bytes longer than a record.
+    unsigned char *pattern = (unsigned char *)malloc(record_size + 26);
+
+    if (pattern == NULL) {
+        perror("malloc error");
+        return 1;
+    }
+
+    for (size_t i = 0; i < record_size + 26; i++) {
+        pattern[i] = patternAt(i);
+    }
+
+    enableFunction enable =
+        (enableFunction)dlsym(RTLD_DEFAULT, "fault_inject_enable");
+    DefaultFileWriter *fileWriter = new DefaultFileWriter("test-file.txt");
+    long long half = count / 2;
+    long long failed = 0;
+    long long refused = 0;
+    int64_t half_submitted = 0;
+    double start = now();
+    double faults_off = 0;
+    double recovery = -1;
+
+    if (fileWriter->openFile() == -1) {
+        perror("fileWriter.openFile()");
+        return 1;
+    }
+
+    for (long long t = 0; t < count; t++) {
+        if (t == half) {
+            if (enable != NULL) {
+                enable(0);
+            }
+
+            faults_off = now();
+            half_submitted = fileWriter->getSubmitted();
+        }
+
+        int64_t submitted = fileWriter->getSubmitted();
+        off_t position = (off_t)t * record_size;
+
+        // A write that fails after it was queued still runs its callback, so
+        // it is only counted here if it was refused.
+        if (fileWriter->write(pattern + position % 26, record_size,
+                              &writeDone, &failed) == -1 &&
+            fileWriter->getSubmitted() == submitted) {
+            refused++;
+        }
+
+        if (t >= half && recovery < 0 &&
+            fileWriter->getCompletedPrefix() >= half_submitted) {
+            recovery = now() - faults_off;
+        }
+    }
+
+    double clean_end = now();
+
+    while (fileWriter->pendingWrites()) {
+        // Failed writes make processQueue() return -1, but the rest of the
+        // queue still has to be drained.
+        fileWriter->processQueue();
+
+        if (recovery < 0 &&
+            fileWriter->getCompletedPrefix() >= half_submitted) {
+            recovery = now() - faults_off;
+        }
+
+        sched_yield();
+    }
+
+    if (recovery < 0) {
+        recovery = now() - faults_off;
+    }
+
+    double elapsed = now() - start;
+    bool write_error = fileWriter->getWriteError();
+    fileWriter->closeFile();
+    delete fileWriter;
+
+    cout << "Backend:     " << ASYNC_FILE_WRITER_BACKEND << endl;
+    cout << "Engine:      " << DefaultFileWriter::engineName() << endl;
+    cout << "Faults:      "
+         << (enable != NULL ? "injected" : "none, shim not loaded") << endl;
+    cout << "Faulty half: " << half / (faults_off - start) << " writes/s" << endl;
+    cout << "Clean half:  " << (count - half) / (clean_end - faults_off)
+         << " writes/s" << endl;
+    cout << "Recovery:    " << recovery * 1000 << " ms" << endl;
+    cout << "Total:       " << elapsed << " s" << endl;
+    cout << "Failed:      " << failed << endl;
+    cout << "Refused:     " << refused << endl;
+    cout << "Write error: " << (write_error ? "yes" : "no") << endl;
+    free(pattern);
+
+    // The file is only complete if no write was lost.
+    if (failed == 0 && refused == 0) {
+        if (!checkFile("test-file.txt", (off_t)count * record_size)) {
+            cout << "Check:       FAILED" << endl;
+            return 1;
+        }
+
+        cout << "Check:       ok" << endl;
+    }
+
+    return 0;
+}
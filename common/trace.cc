@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+
+// The event that names the thread recording it. The name pointer is kept in
+// the length. It lets the events of a thread that has exited keep its name
+// after its ring went to another thread.
+#define TRACE_THREAD_NAME       8
+
+// A ring can hold the events of several threads one after the other, so
+// each event has the id of the thread that recorded it. It fits in what
+// would otherwise be padding.
+typedef struct traceEvent {
+    uint64_t            timestamp;
+    int64_t             offset;
+    int64_t             length;
+    int                 type;
+    int                 threadId;
+} traceEvent;
+
+typedef struct traceRing {
+    traceEvent          *events;
+    // The events recorded so far. The next one goes in slot
+    // recorded % traceCapacity.
+    uint64_t            recorded;
+    // The name and id of the thread using the ring, or of the last one.
+    const char          *name;
+    int                 threadId;
+    // Every ring is on the rings list. The ones whose thread has exited are
+    // on the free list as well.
+    traceRing           *next;
+    traceRing           *nextFree;
+} traceRing;
+
+volatile bool traceEnabled = false;
+
+static size_t traceCapacity = 0;
+static traceRing *rings = NULL;
+static traceRing *freeRings = NULL;
+static int threads = 0;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+// The key whose destructor gives a ring back when its thread exits.
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static __thread traceRing *threadRing = NULL;
+static __thread const char *threadName = NULL;
+// This flag indicates the ring of the thread could not be allocated, so its
+// events are dropped.
+static __thread bool threadFailed = false;
+
+static uint64_t timestamp()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void recordEvent(traceRing *ring, int type, off_t offset,
+                        int64_t length)
+{
+    traceEvent *event = &ring->events[ring->recorded % traceCapacity];
+
+    event->timestamp = timestamp();
+    event->offset = offset;
+    event->length = length;
+    event->type = type;
+    event->threadId = ring->threadId;
+    ring->recorded++;
+}
+
+// Put the ring of an exiting thread on the free list. Its events stay in it
+// until the next thread that takes it overwrites them.
+static void releaseRing(void *context)
+{
+    traceRing *ring = (traceRing *)context;
+
+    // Nothing the thread records from here on can go in the ring.
+    threadRing = NULL;
+    threadFailed = true;
+    pthread_mutex_lock(&ringsLock);
+    ring->nextFree = freeRings;
+    freeRings = ring;
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void createRingKey()
+{
+    if (pthread_key_create(&ringKey, releaseRing) != 0) {
+        // Rings are not reused without the key.
+        ringKey = (pthread_key_t)-1;
+    }
+}
+
+// Get a ring for the calling thread, the ring of a thread that has exited if
+// there is one, or a new one added to the list dumped by traceDump(). The
+// writer starts a short lived thread per open and per batch of file
+// operations, so without reuse the rings would grow without bound.
+static traceRing *createRing()
+{
+    traceRing *ring;
+
+    pthread_once(&ringKeyOnce, createRingKey);
+    pthread_mutex_lock(&ringsLock);
+
+    if (freeRings != NULL) {
+        ring = freeRings;
+        freeRings = ring->nextFree;
+    } else {
+        pthread_mutex_unlock(&ringsLock);
+
+        if ((ring = (traceRing *)malloc(sizeof(traceRing))) == NULL) {
+            return NULL;
+        }
+
+        if ((ring->events = (traceEvent *)malloc(
+                 traceCapacity * sizeof(traceEvent))) == NULL) {
+            free(ring);
+            return NULL;
+        }
+
+        ring->recorded = 0;
+        pthread_mutex_lock(&ringsLock);
+        ring->next = rings;
+        rings = ring;
+    }
+
+    ring->name = threadName;
+    ring->threadId = ++threads;
+    pthread_mutex_unlock(&ringsLock);
+
+    if (ringKey != (pthread_key_t)-1) {
+        pthread_setspecific(ringKey, ring);
+    }
+
+    if (threadName != NULL) {
+        recordEvent(ring, TRACE_THREAD_NAME, 0, (int64_t)(intptr_t)threadName);
+    }
+
+    return ring;
+}
+
+int traceStart(size_t events)
+{
+    pthread_mutex_lock(&ringsLock);
+
+    if (traceCapacity == 0) {
+        traceCapacity = events;
+    }
+
+    pthread_mutex_unlock(&ringsLock);
+
+    if (traceCapacity == 0) {
+        return -1;
+    }
+
+    traceEnabled = true;
+    return 0;
+}
+
+void traceStop()
+{
+    traceEnabled = false;
+}
+
+void traceThreadName(const char *name)
+{
+    threadName = name;
+
+    if (threadRing != NULL) {
+        threadRing->name = name;
+        recordEvent(threadRing, TRACE_THREAD_NAME, 0,
+                    (int64_t)(intptr_t)name);
+    }
+}
+
+// Record an event in the ring of the calling thread. The tracepoints sit
+// between calls and the errno checks after them, so errno is kept.
+void traceRecord(int type, off_t offset, int64_t length)
+{
+    int saved_errno = errno;
+
+    if (threadRing == NULL) {
+        if (threadFailed || (threadRing = createRing()) == NULL) {
+            threadFailed = true;
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    recordEvent(threadRing, type, offset, length);
+    errno = saved_errno;
+}
+
+// Write the name of a thread as Chrome trace metadata.
+static void dumpName(FILE *file, int pid, int tid, const char *name,
+                     bool *first)
+{
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *first ? "" : ",", pid, tid, name);
+    *first = false;
+}
+
+// Write one event as a Chrome trace event. The timestamps are in
+// microseconds.
+static void dumpEvent(FILE *file, int pid, traceEvent *event, bool *first)
+{
+    int tid = event->threadId;
+
+    static const char *names[] = {
+        "submit", "dequeue", "write", "write", "complete", "EAGAIN", "open",
+        "open"
+    };
+    const char *phase = "i";
+
+    if (event->type == TRACE_SYSCALL_START || event->type == TRACE_OPEN_START) {
+        phase = "B";
+    } else if (event->type == TRACE_SYSCALL_END ||
+               event->type == TRACE_OPEN_END) {
+        phase = "E";
+    }
+
+    fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d", *first ? "" : ",", names[event->type],
+            phase, event->timestamp / 1000.0, pid, tid);
+    *first = false;
+
+    if (phase[0] == 'i') {
+        fprintf(file, ",\"s\":\"t\"");
+    }
+
+    if (event->type == TRACE_OPEN_END) {
+        fprintf(file, ",\"args\":{\"fd\":%lld}}", (long long)event->length);
+    } else if (phase[0] != 'B') {
+        fprintf(file, ",\"args\":{\"offset\":%lld,\"bytes\":%lld}}",
+                (long long)event->offset, (long long)event->length);
+    } else {
+        fprintf(file, "}");
+    }
+}
+
+int traceDump(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    int pid = (int)getpid();
+    bool first = true;
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "{\"traceEvents\":[");
+    pthread_mutex_lock(&ringsLock);
+
+    for (traceRing *ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t oldest = ring->recorded > traceCapacity ?
+                          ring->recorded - traceCapacity : 0;
+        // The spans open on the thread whose events are being written.
+        int open_spans = 0;
+        int tid = 0;
+
+        if (ring->name != NULL) {
+            dumpName(file, pid, ring->threadId, ring->name, &first);
+        }
+
+        for (uint64_t e = oldest; e < ring->recorded; e++) {
+            traceEvent *event = &ring->events[e % traceCapacity];
+
+            if (event->threadId != tid) {
+                tid = event->threadId;
+                open_spans = 0;
+            }
+
+            if (event->type == TRACE_THREAD_NAME) {
+                dumpName(file, pid, tid,
+                         (const char *)(intptr_t)event->length, &first);
+                continue;
+            }
+
+            if (event->type == TRACE_SYSCALL_START ||
+                event->type == TRACE_OPEN_START) {
+                open_spans++;
+            } else if (event->type == TRACE_SYSCALL_END ||
+                       event->type == TRACE_OPEN_END) {
+                // The start of the span was overwritten when the ring
+                // wrapped. An end on its own would close a span it does not
+                // belong to.
+                if (open_spans == 0) {
+                    continue;
+                }
+
+                open_spans--;
+            }
+
+            dumpEvent(file, pid, event, &first);
+        }
+    }
+
+    pthread_mutex_unlock(&ringsLock);
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(file) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _Trace_H
+#define _Trace_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The events the writer records. The syscall and open events come in start
+// and end pairs, which become spans in the trace.
+#define TRACE_SUBMIT            0
+#define TRACE_DEQUEUE           1
+#define TRACE_SYSCALL_START     2
+#define TRACE_SYSCALL_END       3
+#define TRACE_COMPLETE          4
+#define TRACE_DEFER             5
+#define TRACE_OPEN_START        6
+#define TRACE_OPEN_END          7
+
+// Event tracing for the writer. While tracing is on, every thread that
+// records an event gets a ring of its own, so recording takes no lock. Each
+// event has a timestamp, an offset and a length, or the result of the open
+// or of a failed write. When a ring is full, the oldest events are
+// overwritten. Tracing is off until traceStart() is called and then costs a
+// flag check per tracepoint. Building with -DNO_TRACE removes the
+// tracepoints altogether.
+//
+// When a thread exits, its ring goes to the next thread that records an
+// event, so the writer's short lived threads do not each keep a ring. Their
+// events can still be dumped until they are overwritten. The rings are never
+// freed.
+extern volatile bool traceEnabled;
+
+// Start tracing with rings of the given number of events. The size is fixed
+// by the first call. Returns -1 if it is 0.
+int traceStart(size_t);
+void traceStop();
+// Name the calling thread in the trace. The name must outlive the trace.
+void traceThreadName(const char *);
+void traceRecord(int, off_t, int64_t);
+// Write the events of every ring to a file as Chrome trace event JSON, which
+// chrome://tracing and Perfetto load. Call it after traceStop(), once the
+// writer is idle. Returns -1 if the file cannot be written.
+int traceDump(const char *);
+
+#ifdef NO_TRACE
+#define TRACE(type, offset, length)
+#else
+#define TRACE(type, offset, length)                         \
+    do {                                                    \
+        if (traceEnabled) {                                 \
+            traceRecord((type), (off_t)(offset),            \
+                        (int64_t)(length));                 \
+        }                                                   \
+    } while (0)
+#endif
+
+#endif
@@ -0,0 +1,340 @@
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include "file-writer.h"
+#include "perf-counters.h"
+#include "trace.h"
+
+using namespace std;
+
+// The events kept per thread when tracing, 8 MiB worth.
+#define TRACE_RING_EVENTS   (256 * 1024)
+// The large offset check writes a record across the 4 GiB boundary and
+// appends one after a hole that ends past 5 GiB, so an offset kept in 32
+// bits anywhere puts them in the wrong place.
+#define LARGE_BOUNDARY      (4LL * 1024 * 1024 * 1024)
+#define LARGE_HOLE_END      (LARGE_BOUNDARY + 1024 * 1024 * 1024)
+// The counter check writes this many records. Built with WRITE_COUNT_START
+// just below INT32_MAX, that takes the write counts past 2^31.
+#define COUNTER_WRITES      2000
+
+void usage()
+{
+    cout << endl;
+    cout << "Usage: %s <write count> [record size [trace file]]" << endl;
+    cout << endl;
+    cout << "Writes \"write count\" records of \"record size\" bytes (default 12, one" << endl;
+    cout << "line of \"Hello World\") to ./test-file.txt, checks the file and reports" << endl;
+    cout << "the throughput of the backend and engine this program was built with." << endl;
+    cout << "Where perf_event_open() is allowed, it also reports CPU counters per write," << endl;
+    cout << "covering the writer's own threads. With a trace file, the writer's events" << endl;
+    cout << "are saved to it as a Chrome trace, for chrome://tracing or Perfetto." << endl;
+    cout << "It then writes records past 4 GiB into the sparse file ./test-large.txt," << endl;
+    cout << "checks them and removes it. Last, it checks the write counts over" << endl;
+    cout << "a short run into ./test-counters.txt." << endl;
+    cout << endl;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Check the file has the expected size and every record made it in order.
+bool checkFile(const char *filename, const unsigned char *record,
+               size_t record_size, long long count)
+{
+    struct stat st;
+    FILE *file;
+    unsigned char *data;
+    bool ok = true;
+
+    if (stat(filename, &st) == -1 || st.st_size != (off_t)record_size * count) {
+        return false;
+    }
+
+    if ((file = fopen(filename, "r")) == NULL) {
+        return false;
+    }
+
+    if ((data = (unsigned char *)malloc(record_size)) == NULL) {
+        fclose(file);
+        return false;
+    }
+
+    for (long long t = 0; t < count && ok; t++) {
+        if (fread(data, 1, record_size, file) != record_size ||
+            memcmp(data, record, record_size) != 0) {
+            ok = false;
+        }
+    }
+
+    free(data);
+    fclose(file);
+    return ok;
+}
+
+// Write a record at the start of a sparse file, another across the 4 GiB
+// boundary with writeAt() and a third after a hole past 5 GiB, then read
+// them back. The file is removed afterwards.
+bool checkLargeOffsets(const char *filename, const unsigned char *record,
+                       size_t record_size)
+{
+    DefaultFileWriter *fileWriter = new DefaultFileWriter(filename);
+    off_t positions[3] = {
+        0, (off_t)(LARGE_BOUNDARY - record_size / 2), (off_t)LARGE_HOLE_END
+    };
+    bool ok = fileWriter->openFile() != -1 &&
+              fileWriter->write(record, record_size) != -1 &&
+              fileWriter->writeHole(LARGE_HOLE_END - record_size) != -1 &&
+              fileWriter->write(record, record_size) != -1 &&
+              fileWriter->writeAt(positions[1], record, record_size) != -1;
+
+    while (ok && fileWriter->pendingWrites()) {
+        if (fileWriter->processQueue() == -1) {
+            ok = false;
+        }
+
+        sched_yield();
+    }
+
+    if (fileWriter->closeFile() == -1) {
+        ok = false;
+    }
+
+    delete fileWriter;
+
+    struct stat st;
+    unsigned char *data = (unsigned char *)malloc(record_size);
+    int fd = open(filename, O_RDONLY);
+
+    if (ok && (data == NULL || fd == -1 || fstat(fd, &st) == -1 ||
+               st.st_size != (off_t)(LARGE_HOLE_END + record_size))) {
+        ok = false;
+    }
+
+    for (int r = 0; r < 3 && ok; r++) {
+        if (pread(fd, data, record_size, positions[r]) !=
+                (ssize_t)record_size ||
+            memcmp(data, record, record_size) != 0) {
+            ok = false;
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    free(data);
+    unlink(filename);
+    return ok;
+}
+
+// Check the write counts start at WRITE_COUNT_START and stay consistent as
+// records are written and completed. Only queued writes are counted, so a
+// write moves the submitted count on by one or, written synchronously or
+// directly, leaves it. The file is removed afterwards.
+bool checkCounters(const char *filename, const unsigned char *record,
+                   size_t record_size)
+{
+    DefaultFileWriter *fileWriter = new DefaultFileWriter(filename);
+    int64_t start = WRITE_COUNT_START;
+    bool ok = fileWriter->openFile() != -1 &&
+              fileWriter->getSubmitted() == start &&
+              fileWriter->getCompleted() == start &&
+              fileWriter->getCompletedPrefix() == start &&
+              fileWriter->queueSize() == 0;
+
+    int64_t last = start;
+
+    for (int i = 0; i < COUNTER_WRITES && ok; i++) {
+        if (fileWriter->write(record, record_size) == -1) {
+            ok = false;
+            break;
+        }
+
+        // A writer thread may complete writes between the reads, so each
+        // count is only checked against the ones read after it.
+        int64_t prefix = fileWriter->getCompletedPrefix();
+        int64_t completed = fileWriter->getCompleted();
+        int64_t queued = fileWriter->queueSize();
+        int64_t submitted = fileWriter->getSubmitted();
+
+        if (submitted < last || submitted > last + 1 || prefix < start ||
+            prefix > submitted || completed < start ||
+            completed > submitted || queued < 0 ||
+            queued > submitted - start) {
+            ok = false;
+        }
+
+        last = submitted;
+    }
+
+    while (ok && fileWriter->pendingWrites()) {
+        if (fileWriter->processQueue() == -1) {
+            ok = false;
+        }
+
+        sched_yield();
+    }
+
+    if (ok && (fileWriter->getSubmitted() != last ||
+               fileWriter->getCompleted() != last ||
+               fileWriter->getCompletedPrefix() != last ||
+               fileWriter->queueSize() != 0)) {
+        ok = false;
+    }
+
+    if (fileWriter->closeFile() == -1) {
+        ok = false;
+    }
+
+    delete fileWriter;
+
+    if (ok && !checkFile(filename, record, record_size, COUNTER_WRITES)) {
+        ok = false;
+    }
+
+    unlink(filename);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        usage();
+        return -1;
+    }
+
+    long long count = strtoll(argv[1], (char **)NULL, 10);
+    size_t record_size = 12;
+
+    if (argc >= 3) {
+        record_size = (size_t)strtol(argv[2], (char **)NULL, 10);
+    }
+
+    if (count < 0 || record_size == 0) {
+        usage();
+        return -1;
+    }
+
+    unsigned char *record = (unsigned char *)malloc(record_size);
+
+    if (record == NULL) {
+        perror("malloc error");
+        return 1;
+    }
+
+    for (size_t i = 0; i < record_size; i++) {
+        record[i] = "Hello World\n"[i % 12];
+    }
+
+    // The counters have to be open before the writer starts its threads.
+    PerfCounters counters;
+    DefaultFileWriter *fileWriter = new DefaultFileWriter("test-file.txt");
+    const char *trace_file = argc == 4 ? argv[3] : NULL;
+
+    if (trace_file != NULL) {
+        traceThreadName("main");
+        traceStart(TRACE_RING_EVENTS);
+    }
+
+    counters.start();
+    double start = now();
+
+    if (fileWriter->openFile() == -1) {
+        perror("fileWriter.openFile()");
+        return 1;
+    }
+
+    for (long long t = 0; t < count; t++) {
+        if (fileWriter->write(record, record_size) == -1) {
+            perror("fileWriter.write() error");
+            fileWriter->cancelWrites();
+            delete fileWriter;
+            return 1;
+        }
+    }
+
+    double submitted = now();
+
+    // Poll on the queue until the file is written.
+    while (fileWriter->pendingWrites()) {
+        if (fileWriter->processQueue() == -1) {
+            perror("fileWriter.processQueue() error");
+            fileWriter->cancelWrites();
+            delete fileWriter;
+            return 1;
+        }
+
+        sched_yield();
+    }
+
+    if (fileWriter->closeFile() == -1) {
+        perror("fileWriter.closeFile()");
+        delete fileWriter;
+        return 1;
+    }
+
+    double finished = now();
+    counters.stop();
+    delete fileWriter;
+
+    if (trace_file != NULL) {
+        traceStop();
+
+        if (traceDump(trace_file) == -1) {
+            perror("traceDump()");
+        }
+    }
+
+    double elapsed = finished - start;
+    double megabytes = (double)record_size * count / (1024 * 1024);
+
+    cout << "Backend:    " << ASYNC_FILE_WRITER_BACKEND << endl;
+    cout << "Engine:     " << DefaultFileWriter::engineName() << endl;
+    cout << "Writes:     " << count << " x " << record_size << " bytes" << endl;
+    cout << "Submit:     " << submitted - start << " s" << endl;
+    cout << "Total:      " << elapsed << " s" << endl;
+
+    if (elapsed > 0) {
+        cout << "Rate:       " << count / elapsed << " writes/s, "
+             << megabytes / elapsed << " MiB/s" << endl;
+    }
+
+    if (counters.available()) {
+        counters.report(cout, count);
+    } else {
+        cout << "Counters:   not available" << endl;
+    }
+
+    if (!checkFile("test-file.txt", record, record_size, count)) {
+        cout << "Check:      FAILED" << endl;
+        free(record);
+        return 1;
+    }
+
+    cout << "Check:      ok" << endl;
+
+    if (!checkLargeOffsets("test-large.txt", record, record_size)) {
+        cout << "Large:      FAILED" << endl;
+        free(record);
+        return 1;
+    }
+
+    cout << "Large:      ok" << endl;
+
+    if (!checkCounters("test-counters.txt", record, record_size)) {
+        cout << "Counts:     FAILED" << endl;
+        free(record);
+        return 1;
+    }
+
+    cout << "Counts:     ok" << endl;
+    free(record);
+    return 0;
+}
@@ -1,76 +1,1254 @@
 #include <iostream>
 #include <stdio.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include "async-file-writer.h"
+#include "crc32c.h"
 
-#define DATA_SZ     4096
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define DATA_SZ         4096
+// The source is mapped MAP_WINDOW_SZ bytes at a time, with up to MAP_WINDOWS
+// windows mapped while their writes are in flight. Each write covers up to
+// MAP_SLICE_SZ bytes of a window.
+#define MAP_WINDOW_SZ   (16 * 1024 * 1024)
+#define MAP_WINDOWS     4
+#define MAP_SLICE_SZ    (256 * 1024)
+// In verify mode the destination is read back every VERIFY_CHUNK_SZ bytes of
+// the copy, once the writes of that chunk have completed. Up to
+// VERIFY_POINTS chunks can wait for their writes.
+#define VERIFY_CHUNK_SZ (4 * 1024 * 1024)
+#define VERIFY_POINTS   16
 
 using namespace std;
 
+// The checksum of one block as it was read from the source. The length is
+// kept because read() can return short blocks. A hole stands for a run of
+// zeros that was skipped instead of written, so it has no checksum.
+typedef struct blockChecksum {
+    off_t       length;
+    uint32_t    crc;
+    bool        hole;
+} blockChecksum;
+
+// A point the verification can catch up to: the number of blocks
+// checksummed before it, and the number of writes that hold them.
+typedef struct verifyPoint {
+    size_t      blocks;
+    int64_t     writes;
+} verifyPoint;
+
+// A window of the source mapping. It is unmapped once the first lastWrite
+// writes have all completed.
+typedef struct mappedWindow {
+    void        *addr;
+    size_t      length;
+    int64_t     lastWrite;
+} mappedWindow;
+
+// The options that apply to every file copied.
+typedef struct copyOptions {
+    bool        verify;
+    bool        sparse;
+    bool        mapped;
+    bool        verbose;
+    // The payload buffers of every writer come from this arena if it is set.
+    BufferArena *arena;
+    // The NUMA node writers and their buffers are placed on, or -1.
+    int         numaNode;
+} copyOptions;
+
+// The state of a single file copy.
+typedef struct copyState {
+    const copyOptions   *options;
+    const char          *dest;
+    AsyncFileWriter     *asyncFileWriter;
+    // The completion fd of the writer, or -1.
+    int                 completionFd;
+    blockChecksum       *checksums;
+    size_t              blocks;
+    size_t              checksumsSize;
+    // The read back of the destination. The first verified blocks have been
+    // checked, and the bytes copied since the last verify point are counted
+    // towards the next one.
+    int                 verifyFd;
+    size_t              verified;
+    off_t               unverifiedBytes;
+    verifyPoint         points[VERIFY_POINTS];
+    int                 pointHead;
+    int                 pointCount;
+    mappedWindow        windows[MAP_WINDOWS];
+    int                 windowHead;
+    int                 windowCount;
+} copyState;
+
+// A directory created by the walker and the mode of its source, which it gets
+// once the copy is done.
+typedef struct dirMode {
+    char        *path;
+    mode_t      mode;
+    dirMode     *next;
+} dirMode;
+
+// A file waiting to be copied by one of the recursive copy workers.
+typedef struct copyJob {
+    char        *source;
+    char        *dest;
+    copyJob     *next;
+} copyJob;
+
+// The state shared by the directory walker and the copy workers. The walker
+// adds jobs and blocks once maxInFlight files are queued or being copied, so
+// the number of open files and queued buffers stays bounded no matter how
+// large the tree is.
+typedef struct copyPool {
+    const copyOptions   *options;
+    copyJob             *listHead;
+    copyJob             *lastJob;
+    int                 inFlight;
+    int                 maxInFlight;
+    int                 failures;
+    // The directories whose modes are set once the copy is done, newest
+    // first. Only the walker uses the list.
+    dirMode             *dirModes;
+    bool                done;
+    pthread_mutex_t     lock;
+    pthread_cond_t      jobReady;
+    pthread_cond_t      slotFree;
+} copyPool;
+
 void usage()
 {
     cout << endl;
-    cout << "Usage: %s <source> <destination>" << endl;
+    cout << "Usage: %s [--verify] [--sparse] [--mmap] [--huge-pages] [-N <node>] [-r [-j <jobs>] [-m <max files>]] <source> <destination>" << endl;
+    cout << endl;
+    cout << "  --verify       Checksum each block as it is copied and confirm the" << endl;
+    cout << "                 destination against those checksums when done." << endl;
+    cout << "  -S, --sparse   Skip holes in the source and blocks of zeros instead" << endl;
+    cout << "                 of writing them, so the destination stays sparse." << endl;
+    cout << "  -M, --mmap     Map the source and write straight from the mapping" << endl;
+    cout << "                 instead of reading it into a buffer." << endl;
+    cout << "  -H, --huge-pages" << endl;
+    cout << "                 Copy blocks into aligned buffers from a huge page" << endl;
+    cout << "                 arena on the local NUMA node instead of malloc()." << endl;
+    cout << "  -N, --numa-node" << endl;
+    cout << "                 Place the writer threads and buffers on this NUMA" << endl;
+    cout << "                 node." << endl;
+    cout << "  -r, --recursive" << endl;
+    cout << "                 Copy the directory tree <source> to <destination>." << endl;
+    cout << "  -j, --jobs     Number of files copied concurrently (default: number" << endl;
+    cout << "                 of online CPUs)." << endl;
+    cout << "  -m, --max-files" << endl;
+    cout << "                 Maximum number of files queued or being copied at" << endl;
+    cout << "                 once (default: 4 times the number of jobs)." << endl;
     cout << endl;
 }
 
-int main(int argc, char **argv)
+// Check if a block is all zeros. The data is scanned 64 bytes at a time with
+// vector loads and only the tail is checked byte by byte.
+bool isZeroBlock(const void *data, size_t length)
 {
-    if (argc != 3) {
-        usage();
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 64 <= length; i += 64) {
+        __m128i acc = _mm_loadu_si128((const __m128i *)(p + i));
+
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 48)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+            0xffff) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 64 <= length; i += 64) {
+        uint8x16_t acc = vld1q_u8(p + i);
+
+        acc = vorrq_u8(acc, vld1q_u8(p + i + 16));
+        acc = vorrq_u8(acc, vld1q_u8(p + i + 32));
+        acc = vorrq_u8(acc, vld1q_u8(p + i + 48));
+
+        if (vmaxvq_u8(acc) != 0) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Report a block of the destination that does not match its checksum.
+int badBlock(copyState *state)
+{
+    fprintf(stderr, "Verify failed: %s: block %lu\n", state->dest,
+            (unsigned long)state->verified);
+    return -1;
+}
+
+// Read the destination back from the last block verified up to block end and
+// compare each block against the checksum computed while the source was
+// streamed through. The source is not read a second time. Returns -1 with a
+// message printed to stderr if a block does not match or the destination
+// cannot be read.
+int verifyBlocks(copyState *state, size_t end)
+{
+    unsigned char data[DATA_SZ];
+
+    // The destination is opened in the background, so it is only opened
+    // here, once writes to it have completed.
+    if (state->verifyFd == -1) {
+        if ((state->verifyFd = open(state->dest, O_RDONLY)) == -1) {
+            fprintf(stderr, "Verify error: %s: %s\n", state->dest,
+                    strerror(errno));
+            return -1;
+        }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(state->verifyFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    for (; state->verified < end; state->verified++) {
+        blockChecksum *block = &state->checksums[state->verified];
+        off_t remaining = block->length;
+        uint32_t crc = 0;
+
+        // Blocks written from a mapping can be larger than DATA_SZ, so the
+        // checksum is built up a piece at a time. A hole has to read back as
+        // zeros.
+        while (remaining > 0) {
+            size_t length = remaining < DATA_SZ ? remaining : DATA_SZ;
+            ssize_t n = read(state->verifyFd, data, length);
+
+            if (n == -1) {
+                fprintf(stderr, "Verify error: %s: %s\n", state->dest,
+                        strerror(errno));
+                return -1;
+            }
+
+            if (n != (ssize_t)length ||
+                (block->hole && !isZeroBlock(data, length))) {
+                return badBlock(state);
+            }
+
+            if (!block->hole) {
+                crc = crc32c(crc, data, length);
+            }
+
+            remaining -= length;
+        }
+
+        if (!block->hole && crc != block->crc) {
+            return badBlock(state);
+        }
+    }
+
+    return 0;
+}
+
+// Verify the blocks of every verify point whose writes have all completed.
+int verifyCompleted(copyState *state)
+{
+    while (state->pointCount > 0) {
+        verifyPoint *point = &state->points[state->pointHead];
+
+        if (state->asyncFileWriter->getCompletedPrefix() < point->writes) {
+            break;
+        }
+
+        if (verifyBlocks(state, point->blocks) == -1) {
+            return -1;
+        }
+
+        state->pointHead = (state->pointHead + 1) % VERIFY_POINTS;
+        state->pointCount--;
+    }
+
+    return 0;
+}
+
+// Count length bytes of copied data towards the next verify point, and add
+// the point once there are VERIFY_CHUNK_SZ of them. The read back of each
+// chunk then overlaps with the writes of the chunks after it and finds the
+// data still in the page cache, instead of reading the whole file again once
+// the copy is done.
+int verifyProgress(copyState *state, off_t length)
+{
+    if (!state->options->verify) {
+        return 0;
+    }
+
+    state->unverifiedBytes += length;
+
+    if (state->unverifiedBytes >= VERIFY_CHUNK_SZ) {
+        // The blocks committed to the staging block are only written once it
+        // is queued.
+        if (state->asyncFileWriter->flush() == -1) {
+            fprintf(stderr, "asyncFileWriter.flush() error: %s: %s\n",
+                    state->dest, strerror(errno));
+            return -1;
+        }
+
+        int slot = (state->pointHead + state->pointCount) % VERIFY_POINTS;
+
+        // If every point is still waiting for its writes, the newest one is
+        // moved forward instead.
+        if (state->pointCount == VERIFY_POINTS) {
+            slot = (slot + VERIFY_POINTS - 1) % VERIFY_POINTS;
+        } else {
+            state->pointCount++;
+        }
+
+        state->points[slot].blocks = state->blocks;
+        state->points[slot].writes = state->asyncFileWriter->getSubmitted();
+        state->unverifiedBytes = 0;
+    }
+
+    return verifyCompleted(state);
+}
+
+// Verify what is left of the destination once it is closed. It must not be
+// longer than the source.
+int verifyCopy(copyState *state)
+{
+    char data;
+
+    if (verifyBlocks(state, state->blocks) == -1) {
         return -1;
     }
 
+    ssize_t n = read(state->verifyFd, &data, 1);
+
+    if (n == -1) {
+        fprintf(stderr, "Verify error: %s: %s\n", state->dest,
+                strerror(errno));
+        return -1;
+    }
+
+    if (n != 0) {
+        return badBlock(state);
+    }
+
+    return 0;
+}
+
+// Free the checksums and close the read back of the destination.
+void releaseState(copyState *state)
+{
+    free(state->checksums);
+
+    if (state->verifyFd != -1) {
+        close(state->verifyFd);
+    }
+}
+
+// Record the checksum of a block, or a hole when data is NULL, for the
+// verify pass. Consecutive holes are merged into one entry.
+int recordChecksum(copyState *state, const void *data, off_t length)
+{
+    if (!state->options->verify) {
+        return 0;
+    }
+
+    if (data == NULL && state->blocks > 0 &&
+        state->checksums[state->blocks - 1].hole) {
+        state->checksums[state->blocks - 1].length += length;
+        return 0;
+    }
+
+    if (state->blocks == state->checksumsSize) {
+        blockChecksum *resized;
+        size_t size = state->checksumsSize ? state->checksumsSize * 2 : 1024;
+
+        resized = (blockChecksum *)realloc(state->checksums,
+                                           size * sizeof(blockChecksum));
+
+        if (resized == NULL) {
+            return -1;
+        }
+
+        state->checksums = resized;
+        state->checksumsSize = size;
+    }
+
+    state->checksums[state->blocks].length = length;
+    state->checksums[state->blocks].hole = data == NULL;
+    state->checksums[state->blocks].crc = data ? crc32c(0, data, length) : 0;
+    state->blocks++;
+    return 0;
+}
+
+// Skip length bytes of the destination, leaving a hole.
+int copyHole(copyState *state, off_t length)
+{
+    if (state->asyncFileWriter->writeHole(length) == -1) {
+        fprintf(stderr, "asyncFileWriter.writeHole() error: %s: %s\n",
+                state->dest, strerror(errno));
+        return -1;
+    }
+
+    if (recordChecksum(state, NULL, length) == -1) {
+        perror("realloc error");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy data from the current source position up to end, or to the end of
+// the file if end is -1. In sparse mode blocks of zeros become holes.
+int copyData(copyState *state, int source_fd, off_t end)
+{
     int n;
+    unsigned char *data;
+    off_t position = end == -1 ? 0 : lseek(source_fd, 0, SEEK_CUR);
+
+    while (end == -1 || position < end) {
+        size_t length = DATA_SZ;
+
+        if (end != -1 && end - position < DATA_SZ) {
+            length = end - position;
+        }
+
+        // Read straight into the writer's staging memory, so the block is
+        // never copied.
+        if ((data = (unsigned char *)state->asyncFileWriter->reserve(
+                 length)) == NULL) {
+            fprintf(stderr, "asyncFileWriter.reserve() error: %s: %s\n",
+                    state->dest, strerror(errno));
+            return -1;
+        }
+
+        if ((n = read(source_fd, data, length)) <= 0) {
+            if (n == -1) {
+                fprintf(stderr, "read error: %s\n", strerror(errno));
+                return -1;
+            }
+
+            break;
+        }
+
+        position += n;
+
+        if (state->options->sparse && isZeroBlock(data, n)) {
+            if (copyHole(state, n) == -1) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (state->asyncFileWriter->commit(n) == -1) {
+            fprintf(stderr, "asyncFileWriter.commit() error: %s: %s\n",
+                    state->dest, strerror(errno));
+            return -1;
+        }
+
+        // Checksum the block while it is still hot in the cache. The staging
+        // memory stays valid until its write completes.
+        if (recordChecksum(state, data, n) == -1) {
+            perror("realloc error");
+            return -1;
+        }
+
+        if (verifyProgress(state, n) == -1) {
+            return -1;
+        }
+    }
+
+    // Queue what is left in the staging block.
+    if (state->asyncFileWriter->flush() == -1) {
+        fprintf(stderr, "asyncFileWriter.flush() error: %s: %s\n",
+                state->dest, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy a sparse source. SEEK_DATA and SEEK_HOLE find the data regions, and
+// the holes between them are never read. If the file system cannot report
+// holes, the whole file is treated as data and only zero blocks are skipped.
+int copySparse(copyState *state, int source_fd)
+{
+    struct stat st;
+
+    if (fstat(source_fd, &st) == -1) {
+        fprintf(stderr, "fstat error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    off_t position = 0;
+
+    while (position < st.st_size) {
+        off_t data_start = position;
+        off_t data_end = st.st_size;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if ((data_start = lseek(source_fd, position, SEEK_DATA)) == -1) {
+            if (errno != ENXIO) {
+                // Holes are not supported here. Copy everything that is left.
+                data_start = position;
+            } else {
+                // The rest of the file is a hole.
+                data_start = st.st_size;
+            }
+        } else if ((data_end = lseek(source_fd, data_start,
+                                     SEEK_HOLE)) == -1) {
+            data_end = st.st_size;
+        }
+#endif
+
+        if (data_start > position &&
+            copyHole(state, data_start - position) == -1) {
+            return -1;
+        }
+
+        if (data_start >= st.st_size) {
+            break;
+        }
+
+        if (lseek(source_fd, data_start, SEEK_SET) == -1) {
+            fprintf(stderr, "lseek error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (copyData(state, source_fd, data_end) == -1) {
+            return -1;
+        }
+
+        position = data_end;
+    }
+
+    return 0;
+}
+
+// Sleep until the writer completes a write. The timeout only matters if the
+// completion fd could not be created.
+void waitForCompletion(copyState *state)
+{
+    struct pollfd completion;
+
+    completion.fd = state->completionFd;
+    completion.events = POLLIN;
+
+    if (completion.fd == -1) {
+        poll(NULL, 0, 1);
+    } else {
+        poll(&completion, 1, -1);
+    }
+}
+
+// Wait until the first count writes have all completed. The worker sleeps on
+// the completion fd in between, so waiting copies do not take CPU from the
+// others. The fd is cleared before the check, so no completion is missed.
+int waitForWrites(copyState *state, int64_t count)
+{
+    while (true) {
+        state->asyncFileWriter->clearCompletionFd();
+
+        if (state->asyncFileWriter->getCompletedPrefix() >= count) {
+            return 0;
+        }
+
+        if (state->asyncFileWriter->getWriteError()) {
+            fprintf(stderr, "Write error detected: %s\n", state->dest);
+            return -1;
+        }
+
+        waitForCompletion(state);
+    }
+}
+
+// Unmap the oldest windows until only keep are left, waiting for the writes
+// from each window to complete first.
+int releaseWindows(copyState *state, int keep)
+{
+    while (state->windowCount > keep) {
+        mappedWindow *window = &state->windows[state->windowHead];
+
+        if (waitForWrites(state, window->lastWrite) == -1) {
+            return -1;
+        }
+
+        munmap(window->addr, window->length);
+        state->windowHead = (state->windowHead + 1) % MAP_WINDOWS;
+        state->windowCount--;
+    }
+
+    return 0;
+}
+
+// Unmap every window without waiting. This is only safe once the writes have
+// completed or been canceled.
+void unmapWindows(copyState *state)
+{
+    while (state->windowCount > 0) {
+        mappedWindow *window = &state->windows[state->windowHead];
+
+        munmap(window->addr, window->length);
+        state->windowHead = (state->windowHead + 1) % MAP_WINDOWS;
+        state->windowCount--;
+    }
+}
+
+// Queue a slice of a mapped window. The writer does not copy it, the data
+// goes from the page cache straight to the write.
+int copySlice(copyState *state, const unsigned char *data, size_t length)
+{
+    if (length == 0) {
+        return 0;
+    }
+
+    if (state->asyncFileWriter->submitWriteNoCopy(data, length) == -1) {
+        fprintf(stderr, "asyncFileWriter.submitWriteNoCopy() error: %s: %s\n",
+                state->dest, strerror(errno));
+        return -1;
+    }
+
+    if (recordChecksum(state, data, length) == -1) {
+        perror("realloc error");
+        return -1;
+    }
+
+    return verifyProgress(state, length);
+}
+
+// Copy a mapped window in slices. In sparse mode each DATA_SZ block is
+// checked for zeros, which end the current slice and become a hole.
+int copyWindow(copyState *state, const unsigned char *data, size_t length)
+{
+    size_t slice_start = 0;
+    size_t position = 0;
+
+    while (position < length) {
+        size_t block = length - position < DATA_SZ ? length - position
+                                                   : DATA_SZ;
+
+        if (state->options->sparse && isZeroBlock(data + position, block)) {
+            if (copySlice(state, data + slice_start,
+                          position - slice_start) == -1 ||
+                copyHole(state, block) == -1) {
+                return -1;
+            }
+
+            position += block;
+            slice_start = position;
+            continue;
+        }
+
+        position += block;
+
+        if (position - slice_start >= MAP_SLICE_SZ) {
+            if (copySlice(state, data + slice_start,
+                          position - slice_start) == -1) {
+                return -1;
+            }
+
+            slice_start = position;
+        }
+    }
+
+    return copySlice(state, data + slice_start, position - slice_start);
+}
+
+// Copy the source from a read only mapping instead of a read() loop. The
+// windows stay mapped until their writes complete, which the caller finishes
+// off with releaseWindows() or unmapWindows().
+int copyMapped(copyState *state, int source_fd)
+{
+    struct stat st;
+
+    if (fstat(source_fd, &st) == -1) {
+        fprintf(stderr, "fstat error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (off_t window_offset = 0; window_offset < st.st_size;
+         window_offset += MAP_WINDOW_SZ) {
+        size_t length = MAP_WINDOW_SZ;
+
+        if (st.st_size - window_offset < MAP_WINDOW_SZ) {
+            length = st.st_size - window_offset;
+        }
+
+        // Make room for the new window.
+        if (releaseWindows(state, MAP_WINDOWS - 1) == -1) {
+            return -1;
+        }
+
+        void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, source_fd,
+                          window_offset);
+
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "mmap error: %s\n", strerror(errno));
+            return -1;
+        }
+
+#ifdef MADV_SEQUENTIAL
+        madvise(addr, length, MADV_SEQUENTIAL);
+#endif
+
+        int slot = (state->windowHead + state->windowCount) % MAP_WINDOWS;
+        mappedWindow *window = &state->windows[slot];
+
+        window->addr = addr;
+        window->length = length;
+        state->windowCount++;
+
+        if (copyWindow(state, (const unsigned char *)addr, length) == -1) {
+            return -1;
+        }
+
+        window->lastWrite = state->asyncFileWriter->getSubmitted();
+    }
+
+    return 0;
+}
+
+// Copy one file through an AsyncFileWriter. The destination open runs in the
+// background while the first blocks are read from the source. Returns 0 on
+// success and -1 on failure with a message printed to stderr.
+int copyFile(const char *source, const char *dest, const copyOptions *options)
+{
     int source_fd;
-    unsigned char data[DATA_SZ];
-    const char *source = argv[1];
-    const char *dest = argv[2];
+    copyState state;
+
+    struct stat st;
 
     if ((source_fd = open(source, O_RDONLY)) == -1) {
-        perror("open error");
-        return 1;
+        fprintf(stderr, "open error: %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(source_fd, &st) == -1) {
+        fprintf(stderr, "fstat error: %s: %s\n", source, strerror(errno));
+        close(source_fd);
+        return -1;
     }
 
     AsyncFileWriter *asyncFileWriter = new AsyncFileWriter(dest);
+    // The destination is created with the permissions of the source, less
+    // the umask, as cp does.
+    asyncFileWriter->setFileMode(st.st_mode & 07777);
+
+    if (options->arena != NULL) {
+        asyncFileWriter->setBufferArena(options->arena);
+    }
+
+    if (options->numaNode != -1 &&
+        asyncFileWriter->setNumaNode(options->numaNode) == -1) {
+        fprintf(stderr, "asyncFileWriter.setNumaNode(): %d: %s\n",
+                options->numaNode, strerror(errno));
+        delete asyncFileWriter;
+        close(source_fd);
+        return -1;
+    }
 
     if (asyncFileWriter->openFile() == -1) {
-        perror("asyncFileWriter.openFile()");
-        return 1;
+        fprintf(stderr, "asyncFileWriter.openFile(): %s: %s\n", dest,
+                strerror(errno));
+        delete asyncFileWriter;
+        close(source_fd);
+        return -1;
     }
 
-    while ((n = read(source_fd, data, DATA_SZ)) > 0) {
-        if (asyncFileWriter->submitWrite(data, n) == -1) {
-            perror("asyncFileWriter.submitWrite() error");
-            asyncFileWriter->cancelWrites();
-            delete asyncFileWriter;
-            return 1;
-        }
+    state.options = options;
+    state.dest = dest;
+    state.asyncFileWriter = asyncFileWriter;
+    state.completionFd = asyncFileWriter->getCompletionFd();
+    state.checksums = NULL;
+    state.blocks = 0;
+    state.checksumsSize = 0;
+    state.verifyFd = -1;
+    state.verified = 0;
+    state.unverifiedBytes = 0;
+    state.pointHead = 0;
+    state.pointCount = 0;
+    state.windowHead = 0;
+    state.windowCount = 0;
+    int ret;
+
+    if (options->mapped) {
+        ret = copyMapped(&state, source_fd);
+    } else if (options->sparse) {
+        ret = copySparse(&state, source_fd);
+    } else {
+        ret = copyData(&state, source_fd, -1);
+    }
+
+    close(source_fd);
+
+    if (ret == -1) {
+        asyncFileWriter->cancelWrites();
+        unmapWindows(&state);
+        delete asyncFileWriter;
+        releaseState(&state);
+        return -1;
+    }
+
+    if (options->verbose) {
+        cout << "Submitted:  " << asyncFileWriter->getSubmitted() << endl;
     }
 
-    cout << "Submitted:  " << asyncFileWriter->getSubmitted() << endl;
     bool reported = false;
 
-    // Poll on the queue until the file is written.
-    while (asyncFileWriter->pendingWrites()) {
+    // Sleep on the completion fd until the file is written. It is cleared
+    // before the check, so no completion is missed.
+    while (true) {
+        asyncFileWriter->clearCompletionFd();
+
+        if (!asyncFileWriter->pendingWrites()) {
+            break;
+        }
+
         if (asyncFileWriter->getWriteError()) {
-            cout << "Write error detected." << endl;
+            fprintf(stderr, "Write error detected: %s\n", dest);
+            unmapWindows(&state);
             delete asyncFileWriter;
-            return 1;
+            releaseState(&state);
+            return -1;
+        }
+
+        // The chunks whose writes are done are verified while the rest
+        // drain.
+        if (verifyCompleted(&state) == -1) {
+            asyncFileWriter->cancelWrites();
+            unmapWindows(&state);
+            delete asyncFileWriter;
+            releaseState(&state);
+            return -1;
+        }
+
+        if (options->verbose) {
+            cout << "Completed:  " << asyncFileWriter->getCompleted() << endl;
+            cout << "Queue size: " << asyncFileWriter->queueSize() << endl;
         }
 
-        cout << "Completed:  " << asyncFileWriter->getCompleted() << endl;
-        cout << "Queue size: " << asyncFileWriter->queueSize() << endl;
         reported = true;
+        waitForCompletion(&state);
     }
 
-    if (!reported) {
+    if (!reported && options->verbose) {
         cout << "Completed:  " << asyncFileWriter->getCompleted() << endl;
     }
 
+    // Every write has completed, so the mapping is no longer used.
+    unmapWindows(&state);
+
     // The destructor will also close the file, but it's best to do so
-    // explicity IMO.
-    asyncFileWriter->closeFile();
+    // explicity IMO. In sparse mode this also sets the final length if the
+    // file ends in a hole.
+    if (asyncFileWriter->closeFile() == -1) {
+        fprintf(stderr, "asyncFileWriter.closeFile(): %s: %s\n", dest,
+                strerror(errno));
+        delete asyncFileWriter;
+        releaseState(&state);
+        return -1;
+    }
+
     delete asyncFileWriter;
-    close(source_fd);
+
+    if (options->verify) {
+        if (verifyCopy(&state) == -1) {
+            releaseState(&state);
+            return -1;
+        }
+
+        if (options->verbose) {
+            cout << "Verified:   " << state.blocks << " blocks" << endl;
+        }
+    }
+
+    releaseState(&state);
     return 0;
 }
+
+// The recursive copy worker thread. Each worker takes the next file off the
+// job list and copies it until the walker is done and the list is empty.
+void *copyWorker(void *context)
+{
+    copyPool *pool = (copyPool *)context;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->listHead == NULL && !pool->done) {
+            pthread_cond_wait(&pool->jobReady, &pool->lock);
+        }
+
+        if (pool->listHead == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        copyJob *job = pool->listHead;
+        pool->listHead = job->next;
+
+        if (pool->listHead == NULL) {
+            pool->lastJob = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        int ret = copyFile(job->source, job->dest, pool->options);
+        free(job->source);
+        free(job->dest);
+        free(job);
+        // Release the in-flight slot so the walker can queue another file.
+        pthread_mutex_lock(&pool->lock);
+
+        if (ret == -1) {
+            pool->failures++;
+        }
+
+        pool->inFlight--;
+        pthread_cond_signal(&pool->slotFree);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return (void *)0;
+}
+
+// Queue a file for the copy workers. This blocks while the in-flight limit
+// is reached.
+int queueCopy(copyPool *pool, const char *source, const char *dest)
+{
+    copyJob *job;
+
+    if ((job = (copyJob *)malloc(sizeof(copyJob))) == NULL) {
+        return -1;
+    }
+
+    if ((job->source = strdup(source)) == NULL) {
+        free(job);
+        return -1;
+    }
+
+    if ((job->dest = strdup(dest)) == NULL) {
+        free(job->source);
+        free(job);
+        return -1;
+    }
+
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->inFlight >= pool->maxInFlight) {
+        pthread_cond_wait(&pool->slotFree, &pool->lock);
+    }
+
+    if (pool->listHead == NULL) {
+        pool->listHead = job;
+    } else {
+        pool->lastJob->next = job;
+    }
+
+    pool->lastJob = job;
+    pool->inFlight++;
+    pthread_cond_signal(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Remember to give a directory created by the walker the mode of its source
+// once the copy is done. Until then it is only accessible to its owner, so
+// the files below it can be created even if the source is read only.
+int deferMode(copyPool *pool, const char *path, mode_t mode)
+{
+    dirMode *entry;
+
+    if ((entry = (dirMode *)malloc(sizeof(dirMode))) == NULL) {
+        return -1;
+    }
+
+    if ((entry->path = strdup(path)) == NULL) {
+        free(entry);
+        return -1;
+    }
+
+    entry->mode = mode;
+    entry->next = pool->dirModes;
+    pool->dirModes = entry;
+    return 0;
+}
+
+// Set the modes of the directories created by the walker. The list is newest
+// first, so a directory is done before its parent, which could otherwise
+// become impossible to get through. Returns the number of failures.
+int applyModes(copyPool *pool)
+{
+    int failures = 0;
+
+    while (pool->dirModes != NULL) {
+        dirMode *entry = pool->dirModes;
+
+        if (chmod(entry->path, entry->mode) == -1) {
+            fprintf(stderr, "chmod error: %s: %s\n", entry->path,
+                    strerror(errno));
+            failures++;
+        }
+
+        pool->dirModes = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+
+    return failures;
+}
+
+// Walk the source tree depth first. Directories and symbolic links are
+// created here so they exist before any file below them is queued. Regular
+// files are handed to the copy workers. Returns the number of failures.
+int walkTree(copyPool *pool, const char *source, const char *dest)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char source_path[PATH_MAX];
+    char dest_path[PATH_MAX];
+    int failures = 0;
+
+    if (stat(source, &st) == -1) {
+        fprintf(stderr, "stat error: %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    if (mkdir(dest, S_IRWXU) == 0) {
+        if (deferMode(pool, dest, st.st_mode & 07777) == -1) {
+            perror("deferMode() error");
+            failures++;
+        }
+    } else if (errno != EEXIST) {
+        fprintf(stderr, "mkdir error: %s: %s\n", dest, strerror(errno));
+        return 1;
+    }
+
+    if ((dir = opendir(source)) == NULL) {
+        fprintf(stderr, "opendir error: %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (snprintf(source_path, sizeof(source_path), "%s/%s", source,
+                     entry->d_name) >= (int)sizeof(source_path) ||
+            snprintf(dest_path, sizeof(dest_path), "%s/%s", dest,
+                     entry->d_name) >= (int)sizeof(dest_path)) {
+            fprintf(stderr, "path too long: %s/%s\n", source, entry->d_name);
+            failures++;
+            continue;
+        }
+
+        if (lstat(source_path, &st) == -1) {
+            fprintf(stderr, "stat error: %s: %s\n", source_path,
+                    strerror(errno));
+            failures++;
+        } else if (S_ISDIR(st.st_mode)) {
+            failures += walkTree(pool, source_path, dest_path);
+        } else if (S_ISREG(st.st_mode)) {
+            if (queueCopy(pool, source_path, dest_path) == -1) {
+                perror("queueCopy() error");
+                failures++;
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(source_path, target, sizeof(target) - 1);
+
+            if (len == -1) {
+                fprintf(stderr, "readlink error: %s: %s\n", source_path,
+                        strerror(errno));
+                failures++;
+            } else {
+                target[len] = '\0';
+
+                if (symlink(target, dest_path) == -1) {
+                    fprintf(stderr, "symlink error: %s: %s\n", dest_path,
+                            strerror(errno));
+                    failures++;
+                }
+            }
+        } else {
+            fprintf(stderr, "skipping special file: %s\n", source_path);
+        }
+    }
+
+    closedir(dir);
+    return failures;
+}
+
+// Copy a directory tree with a pool of worker threads. Returns the number of
+// files that could not be copied.
+int copyTree(const char *source, const char *dest, const copyOptions *options,
+             int jobs, int max_in_flight)
+{
+    copyPool pool;
+    pthread_t *workers;
+    int started = 0;
+    int failures;
+
+    pool.options = options;
+    pool.listHead = NULL;
+    pool.lastJob = NULL;
+    pool.inFlight = 0;
+    pool.maxInFlight = max_in_flight;
+    pool.failures = 0;
+    pool.dirModes = NULL;
+    pool.done = false;
+
+    if ((workers = (pthread_t *)malloc(jobs * sizeof(pthread_t))) == NULL) {
+        return 1;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.jobReady, NULL);
+    pthread_cond_init(&pool.slotFree, NULL);
+
+    for (int t = 0; t < jobs; t++) {
+        if (pthread_create(&workers[t], NULL, copyWorker, &pool) != 0) {
+            break;
+        }
+
+        started++;
+    }
+
+    if (started == 0) {
+        failures = 1;
+    } else {
+        failures = walkTree(&pool, source, dest);
+    }
+
+    // Let the workers finish the remaining jobs and exit.
+    pthread_mutex_lock(&pool.lock);
+    pool.done = true;
+    pthread_cond_broadcast(&pool.jobReady);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    // Every file is copied, so the directories can get their modes.
+    failures += pool.failures + applyModes(&pool);
+    pthread_cond_destroy(&pool.slotFree);
+    pthread_cond_destroy(&pool.jobReady);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"verify", no_argument, NULL, 'v'},
+        {"sparse", no_argument, NULL, 'S'},
+        {"mmap", no_argument, NULL, 'M'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"numa-node", required_argument, NULL, 'N'},
+        {"recursive", no_argument, NULL, 'r'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"max-files", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0}
+    };
+    copyOptions options;
+    bool recursive = false;
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_in_flight = 0;
+    int opt;
+
+    options.verify = false;
+    options.sparse = false;
+    options.mapped = false;
+    options.arena = NULL;
+    options.numaNode = -1;
+    options.verbose = true;
+
+    while ((opt = getopt_long(argc, argv, "vSMHN:rj:m:", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'v':
+            options.verify = true;
+            break;
+        case 'S':
+            options.sparse = true;
+            break;
+        case 'M':
+            options.mapped = true;
+            break;
+        case 'H':
+            // The arena is shared by all copy workers and lives until the
+            // process exits.
+            if (options.arena == NULL) {
+                options.arena = new BufferArena();
+            }
+
+            break;
+        case 'N':
+            options.numaNode = (int)strtol(optarg, (char **)NULL, 10);
+            break;
+        case 'r':
+            recursive = true;
+            break;
+        case 'j':
+            jobs = (int)strtol(optarg, (char **)NULL, 10);
+            break;
+        case 'm':
+            max_in_flight = (int)strtol(optarg, (char **)NULL, 10);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return -1;
+    }
+
+    const char *source = argv[optind];
+    const char *dest = argv[optind + 1];
+
+    if (recursive) {
+        if (jobs < 1) {
+            jobs = 1;
+        }
+
+        if (max_in_flight < jobs) {
+            max_in_flight = max_in_flight > 0 ? jobs : jobs * 4;
+        }
+
+        // Per file progress from many workers would just be noise.
+        options.verbose = false;
+        int failures = copyTree(source, dest, &options, jobs, max_in_flight);
+
+        if (failures > 0) {
+            cout << "Failed:     " << failures << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    return copyFile(source, dest, &options) == -1 ? 1 : 0;
+}
@@ -1,25 +1,221 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
 #include "async-file-writer.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+// The size of the staging blocks reserve() hands out, and the number of
+// written blocks kept for reuse.
+#define STAGING_BLOCK_SZ                (64 * 1024)
+#define STAGING_FREE_BLOCKS             16
+
+// The alignment of the buffer of buffered synchronous mode, enough for
+// O_DIRECT on any common device.
+#define SYNC_BUFFER_ALIGNMENT           4096
+
+// The largest write adaptive dispatch writes directly, the weight of a new
+// latency sample in its running averages, and how often it takes the path
+// it currently loses on to measure it again.
+#define ADAPTIVE_DISPATCH_MAX_SZ        (64 * 1024)
+#define ADAPTIVE_DISPATCH_WEIGHT        0.125
+#define ADAPTIVE_DISPATCH_PROBE         64
+
+// The file operation types.
+#define FILE_OPERATION_CLOSE            0
+#define FILE_OPERATION_SYNC             1
+#define FILE_OPERATION_UNLINK           2
+#define FILE_OPERATION_RENAME           3
+#define FILE_OPERATION_TRUNCATE         4
+
+// Write the rest of count bytes at offset, after the *done bytes already
+// written, resuming after short writes and interrupted calls. The count is
+// kept up to date as it goes, so a thread canceled in pwrite() leaves how far
+// it got. Returns the bytes written, which is less than count only if an
+// error stopped it, or -1 if nothing was written.
+static ssize_t pwriteCounted(int fd, const void *data, size_t count,
+                             off_t offset, size_t *done)
+{
+    while (*done < count) {
+        ssize_t wbytes = pwrite(fd, (const unsigned char *)data + *done,
+                                count - *done, offset + *done);
+
+        if (wbytes == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (wbytes <= 0) {
+            return *done > 0 ? (ssize_t)*done : -1;
+        }
+
+        *done += wbytes;
+    }
+
+    return *done;
+}
+
+// Write all of count bytes at offset, like pwriteCounted().
+static ssize_t pwriteAll(int fd, const void *data, size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    return pwriteCounted(fd, data, count, offset, &done);
+}
+
+// The most buffers one pwritev() call takes.
+#ifndef IOV_MAX
+#define IOV_MAX                         1024
+#endif
+
+// Write all of the count bytes of an iovec array at offset, like pwriteAll().
+static ssize_t pwritevAll(int fd, const struct iovec *iov, int iovcnt,
+                          size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t wbytes = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+                                 offset + done);
+
+        if (wbytes == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (wbytes <= 0) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+
+        done += wbytes;
+
+        // Skip the buffers written in full and finish one written in part on
+        // its own, so the array is never modified.
+        while (iovcnt > 0 && (size_t)wbytes >= iov->iov_len) {
+            wbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (wbytes > 0) {
+            size_t rest = iov->iov_len - wbytes;
+            ssize_t more = pwriteAll(fd, (const unsigned char *)iov->iov_base +
+                                     wbytes, rest, offset + done);
+
+            if (more > 0) {
+                done += more;
+            }
+
+            if (more != (ssize_t)rest) {
+                return done;
+            }
+
+            iov++;
+            iovcnt--;
+        }
+    }
+
+    return done;
+}
+
+// Write the data of an iovec array at offset with pwrite() or pwritev(),
+// between the syscall tracepoints.
+static ssize_t pwriteData(int fd, const struct iovec *iov, int iovcnt,
+                          size_t count, off_t offset)
+{
+    ssize_t wbytes;
+
+    TRACE(TRACE_SYSCALL_START, offset, count);
+
+    if (iovcnt == 1) {
+        wbytes = pwriteAll(fd, iov[0].iov_base, count, offset);
+    } else {
+        wbytes = pwritevAll(fd, iov, iovcnt, count, offset);
+    }
+
+    TRACE(TRACE_SYSCALL_END, offset, wbytes);
+    return wbytes;
+}
+
+static double monotonicTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copy the buffers of an iovec array one after the other to dest.
+static void gather(unsigned char *dest, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+}
 
 AsyncFileWriter::AsyncFileWriter(const char *filename)
 {
     listHead = NULL;
     lastBuffer = NULL;
+    bulkHead = NULL;
+    bulkLastBuffer = NULL;
+    writePriority = WRITE_PRIORITY_NORMAL;
+    ioPriorityClass = 0;
+    ioPriorityLevel = 0;
+    cpuAffinitySet = false;
+    schedulingPolicy = SCHED_OTHER;
+    schedulingPriority = 0;
+    schedulingSet = false;
+    numaNode = -1;
+    numaAffinitySet = false;
     fd = -1;
     this->filename = filename;
     openFlags = O_WRONLY|O_CREAT|O_TRUNC;
     openMode = S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
-    submitted = 0;
-    completed = 0;
+    bufferArena = NULL;
+    offset = 0;
+    trailingHole = false;
+    positionalEnd = 0;
+    stagingBlock = NULL;
+    stagingUsed = 0;
+    stagingSize = 0;
+    stagingFree = NULL;
+    stagingFreeCount = 0;
+    submitted = WRITE_COUNT_START;
+    completed = WRITE_COUNT_START;
+    completionReadFd = -1;
+    completionWriteFd = -1;
+    adaptiveDispatch = false;
+    directLatency = 0;
+    queuedLatency = 0;
+    dispatchProbe = 0;
     synchronous = false;
+    syncBuffer = NULL;
+    syncBufferSize = 0;
+    syncBufferUsed = 0;
+    syncBufferOffset = 0;
     closeCalled = false;
     writeError = false;
+    refuseWrites = false;
     opened = false;
+    openStarted = false;
+    operationHead = NULL;
+    operationTail = NULL;
+    operationsRunning = false;
     initError = false;
 
     if (pthread_mutex_init(&openedLock, NULL) != 0) {
         initError = true;
     }
 
+    if (pthread_cond_init(&openedCond, NULL) != 0) {
+        initError = true;
+    }
+
     if (pthread_mutex_init(&listHeadLock, NULL) != 0) {
         initError = true;
     }
@@ -32,7 +228,17 @@ AsyncFileWriter::AsyncFileWriter(const char *filename)
         initError = true;
     }
 
+    if (pthread_mutex_init(&stagingLock, NULL) != 0) {
+        initError = true;
+    }
+
+    if (pthread_cond_init(&writerCond, NULL) != 0) {
+        initError = true;
+    }
+
     writerStarted = false;
+    cancelRequested = false;
+    writerExited = false;
 }
 
 AsyncFileWriter::~AsyncFileWriter()
@@ -43,12 +249,42 @@ AsyncFileWriter::~AsyncFileWriter()
     // completed, cancelWrites() doesn't do anything. We call it just to be
     // sure all memory allocated has really been freed to avoid memory leaks.
     cancelWrites();
-    closeFile();
+
+    // A buffer that cannot be written out is discarded so the file is still
+    // closed.
+    if (closeFile() == -1 && !closeCalled) {
+        syncBufferUsed = 0;
+        closeFile();
+    }
+
+    free(syncBuffer);
+
+    // Free the staging blocks. Any data committed but not flushed is lost.
+    if (stagingBlock != NULL) {
+        releaseStagingBlock(stagingBlock, stagingSize);
+    }
+
+    while (stagingFree != NULL) {
+        void *block = stagingFree;
+
+        stagingFree = *(void **)block;
+
+        if (bufferArena != NULL) {
+            bufferArena->release(block, STAGING_BLOCK_SZ);
+        } else {
+            free(block);
+        }
+    }
 
     // Clean up the open thread attributes. The attributes will have been set
-    // only if an attempt to open the file happened.
+    // only if an attempt to open the file happened. The operation thread uses
+    // this object, so wait for it as well.
     pthread_mutex_lock(&openedLock);
 
+    while (operationsRunning) {
+        pthread_cond_wait(&openedCond, &openedLock);
+    }
+
     if (opened) {
         pthread_attr_destroy(&attr);
     }
@@ -60,6 +296,128 @@ AsyncFileWriter::~AsyncFileWriter()
     pthread_mutex_destroy(&listHeadLock);
     pthread_mutex_destroy(&writeErrorLock);
     pthread_mutex_destroy(&completedLock);
+    pthread_mutex_destroy(&stagingLock);
+    pthread_cond_destroy(&openedCond);
+    pthread_cond_destroy(&writerCond);
+
+    // The writer thread is gone, so nothing signals the completion fd now.
+    if (completionWriteFd != completionReadFd) {
+        close(completionWriteFd);
+    }
+
+    if (completionReadFd != -1) {
+        close(completionReadFd);
+    }
+}
+
+// Free a buffer and its data if the data was copied by the writer.
+void AsyncFileWriter::freeBuffer(aioBuffer *buffer)
+{
+    pthread_mutex_destroy(&buffer->aioBufferLock);
+
+    if (buffer->stagingSize > 0) {
+        releaseStagingBlock(buffer->data, buffer->stagingSize);
+    } else if (buffer->ownsData) {
+        if (bufferArena != NULL) {
+            bufferArena->release(buffer->data, buffer->count);
+        } else {
+            free(buffer->data);
+        }
+    }
+
+    free(buffer);
+}
+
+// Set the CPU affinity of a thread about to be created, so it never starts
+// on a CPU it is not allowed to run on.
+int AsyncFileWriter::initThreadAttributes(pthread_attr_t *thread_attr)
+{
+#ifdef __linux__
+    if (cpuAffinitySet) {
+        return pthread_attr_setaffinity_np(thread_attr, sizeof(cpu_set_t),
+                                           &cpuAffinity);
+    }
+
+    if (numaAffinitySet) {
+        return pthread_attr_setaffinity_np(thread_attr, sizeof(cpu_set_t),
+                                           &numaAffinity);
+    }
+#endif
+
+    return 0;
+}
+
+// Apply the scheduling and I/O priority settings to the calling thread. This
+// runs at the start of the thread instead of through its attributes, so a
+// policy the process has no privilege for leaves the thread at the default
+// instead of failing to create it.
+void AsyncFileWriter::configureThread()
+{
+    if (schedulingSet) {
+        struct sched_param param;
+
+        param.sched_priority = schedulingPriority;
+        pthread_setschedparam(pthread_self(), schedulingPolicy, &param);
+    }
+
+    if (ioPriorityClass != 0) {
+        setThreadIOPriority(ioPriorityClass, ioPriorityLevel);
+    }
+}
+
+// Get a staging block of size bytes, reusing a written one if it is the
+// standard size.
+void *AsyncFileWriter::allocateStagingBlock(size_t size)
+{
+    void *block = NULL;
+
+    if (size == STAGING_BLOCK_SZ) {
+        pthread_mutex_lock(&stagingLock);
+        if (stagingFree != NULL) {
+            block = stagingFree;
+            stagingFree = *(void **)block;
+            stagingFreeCount--;
+        }
+        pthread_mutex_unlock(&stagingLock);
+
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    if (bufferArena != NULL) {
+        return bufferArena->allocate(size);
+    }
+
+    return malloc(size);
+}
+
+// Keep a written staging block for reuse, or free it if it is larger than
+// the standard size or enough blocks are kept already.
+void AsyncFileWriter::releaseStagingBlock(void *block, size_t size)
+{
+    if (size == STAGING_BLOCK_SZ) {
+        bool kept = false;
+
+        pthread_mutex_lock(&stagingLock);
+        if (stagingFreeCount < STAGING_FREE_BLOCKS) {
+            *(void **)block = stagingFree;
+            stagingFree = block;
+            stagingFreeCount++;
+            kept = true;
+        }
+        pthread_mutex_unlock(&stagingLock);
+
+        if (kept) {
+            return;
+        }
+    }
+
+    if (bufferArena != NULL) {
+        bufferArena->release(block, size);
+    } else {
+        free(block);
+    }
 }
 
 // This is the private open thread helper method. This recieves a pointer
@@ -73,13 +431,19 @@ void *AsyncFileWriter::thr_open_helper(void *context) {
 // The actual private thread open method.
 void AsyncFileWriter::thr_open()
 {
+    configureThread();
+    traceThreadName("open");
+
     pthread_mutex_lock(&openedLock);
 
     if (!opened) {
         // We don't need to check the result of open. If fd is -1 and opened
         // is true, we know there was a problem.
+        TRACE(TRACE_OPEN_START, 0, 0);
         fd = open(filename, openFlags, openMode);
+        TRACE(TRACE_OPEN_END, 0, fd);
         opened = true;
+        pthread_cond_broadcast(&openedCond);
     }
 
     pthread_mutex_unlock(&openedLock);
@@ -93,89 +457,232 @@ void *AsyncFileWriter::thr_writer_helper(void *context) {
     return (void *)0;
 }
 
+// Make the completion fd readable, if there is one. A failed write to it
+// means it already is.
+static void signalCompletion(int notify_fd, bool notify_eventfd)
+{
+    if (notify_fd == -1) {
+        return;
+    }
+
+    if (notify_eventfd) {
+        uint64_t one = 1;
+
+        if (::write(notify_fd, &one, sizeof(one)) == -1) {
+            // The counter is already readable.
+        }
+    } else {
+        char one = 1;
+
+        if (::write(notify_fd, &one, sizeof(one)) == -1) {
+            // The pipe is full, so it is already readable.
+        }
+    }
+}
+
+// Finish every write in both lanes with an error once the open has failed.
+// No more can be queued, since submitting reports the open error. Runs on the
+// writer thread, which calls the callbacks with -1.
+void AsyncFileWriter::failQueuedWrites()
+{
+    pthread_mutex_lock(&listHeadLock);
+    aioBuffer *lanes[2] = { listHead, bulkHead };
+    listHead = NULL;
+    lastBuffer = NULL;
+    bulkHead = NULL;
+    bulkLastBuffer = NULL;
+    pthread_mutex_unlock(&listHeadLock);
+
+    pthread_mutex_lock(&writeErrorLock);
+    writeError = true;
+    pthread_mutex_unlock(&writeErrorLock);
+
+    for (int l = 0; l < 2; l++) {
+        aioBuffer *current = lanes[l];
+
+        while (current != NULL) {
+            aioBuffer *removal = current;
+
+            current = current->next;
+            TRACE(TRACE_COMPLETE, removal->offset, -1);
+            pthread_mutex_lock(&completedLock);
+            completed++;
+            pthread_mutex_unlock(&completedLock);
+
+            if (removal->callback != NULL) {
+                removal->callback(removal->callbackContext, -1, 0);
+            }
+
+            freeBuffer(removal);
+        }
+    }
+
+    pthread_mutex_lock(&completedLock);
+    int notify_fd = completionWriteFd;
+    bool notify_eventfd = completionWriteFd == completionReadFd;
+    pthread_mutex_unlock(&completedLock);
+    signalCompletion(notify_fd, notify_eventfd);
+}
+
+// The cleanup handler of a writer thread canceled in pwrite(). It tells
+// cancelWrites() the thread has stopped, as the thread does when it stops on
+// its own.
+void AsyncFileWriter::writerCanceled(void *context)
+{
+    AsyncFileWriter *writer = (AsyncFileWriter *)context;
+
+    pthread_mutex_lock(&writer->listHeadLock);
+    writer->writerExited = true;
+    pthread_cond_broadcast(&writer->writerCond);
+    pthread_mutex_unlock(&writer->listHeadLock);
+}
+
 // The actual private thread writer method.
 void AsyncFileWriter::thr_writer()
 {
-    int write_fd;
+    configureThread();
+    traceThreadName("writer");
 
-    while (true) {
-        pthread_testcancel();
+    // Cancellation is only enabled around pwrite(), where no locks are held.
+    // The thread normally stops on its own when cancelWrites() asks it to,
+    // and pthread_cancel() is only its last resort.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&listHeadLock);
+
+    while (!cancelRequested) {
         // Walk all of the existing buffers until we get to the end of the
-        // current list of aioBuffer objects. The submitWrite() method will
-        // reset listHead if it is ever set to NULL here.
-        pthread_mutex_lock(&listHeadLock);
+        // current lists of aioBuffer objects. The submitWrite() method will
+        // reset the head of a lane if it is ever set to NULL here. The normal
+        // lane is checked again before every write, so a normal write never
+        // waits for more than the bulk write in progress.
+        aioBuffer **lane = listHead != NULL ? &listHead : &bulkHead;
+
+        if (*lane == NULL) {
+            // Both lanes are empty. Sleep until submitWrite() queues a write
+            // or cancelWrites() stops the thread.
+            pthread_cond_wait(&writerCond, &listHeadLock);
+            continue;
+        }
 
-        while (listHead != NULL) {
+        pthread_mutex_unlock(&listHeadLock);
+        aioBuffer *current = *lane;
+
+        // It is safe to use the head of the lane because we are the only
+        // method that alters it once it has been set until it is NULL
+        // again. This is the only place the aioBuffer attributes besides
+        // the next pointer are used as well.
+        if (current->fd != -1) {
+            TRACE(TRACE_DEQUEUE, current->offset, current->count);
+            TRACE(TRACE_SYSCALL_START, current->offset, current->count);
+            ssize_t wbytes;
+
+            pthread_cleanup_push(&AsyncFileWriter::writerCanceled, this);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            wbytes = pwriteCounted(current->fd, current->data, current->count,
+                                   current->offset, &current->written);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            pthread_cleanup_pop(0);
+            TRACE(TRACE_SYSCALL_END, current->offset, wbytes);
+            double done_time = current->submitTime > 0 ? monotonicTime() : 0;
+            int status = 0;
+
+            if (wbytes != (ssize_t)current->count) {
+                // There was a write error. Short writes are resumed by
+                // pwriteAll(), so this is one that made no progress. Set
+                // the writeError flag. A write with a callback reports the
+                // error through it, so it does not stop later writes.
+                status = -1;
+                pthread_mutex_lock(&writeErrorLock);
+                writeError = true;
+
+                if (current->callback == NULL) {
+                    refuseWrites = true;
+                }
+
+                pthread_mutex_unlock(&writeErrorLock);
+            }
+
+            // Lock the lists and the aioBuffer so that the head of the
+            // lane can be modified to the value of its aioBuffer next
+            // pointer. We advance the head because we are now removing
+            // its aioBuffer.
+            pthread_mutex_lock(&listHeadLock);
+            pthread_mutex_lock(&current->aioBufferLock);
+            aioBuffer *removal = current;
+            *lane = current->next;
+            pthread_mutex_unlock(&removal->aioBufferLock);
             pthread_mutex_unlock(&listHeadLock);
+            // Update the completed count.
+            pthread_mutex_lock(&completedLock);
+            completed++;
 
-            // It is safe to use listHead because we are the only method that
-            // alters it once it has been set until it is NULL again. This is
-            // the only place the aioBuffer attributes besides the next pointer
-            // are used as well.
-            if (listHead->fd != -1) {
-                int wbytes = write(listHead->fd, listHead->data,
-                                   listHead->count);
-
-                if (wbytes != listHead->count) {
-                    // There was either a short write or a write error. Set
-                    // the writeError flag.
-                    pthread_mutex_lock(&writeErrorLock);
-                    writeError = true;
-                    pthread_mutex_unlock(&writeErrorLock);
-                }
+            if (done_time > 0) {
+                queuedLatency += (done_time - removal->submitTime -
+                                  queuedLatency) * ADAPTIVE_DISPATCH_WEIGHT;
+            }
 
-                // Lock the listHead and its aioBuffer so that listHead can
-                // be modified to the value of its aioBuffer next pointer.
-                // We advance the listHead because we are now removing its
-                // aioBuffer.
-                pthread_mutex_lock(&listHeadLock);
-                pthread_mutex_lock(&listHead->aioBufferLock);
-                aioBuffer *removal = listHead;
-                listHead = listHead->next;
-                pthread_mutex_unlock(&removal->aioBufferLock);
-                // Free the written aioBuffer.
-                pthread_mutex_destroy(&removal->aioBufferLock);
-                free(removal);
-                pthread_mutex_unlock(&listHeadLock);
-                // Update the completed count.
-                pthread_mutex_lock(&completedLock);
-                completed++;
-                pthread_mutex_unlock(&completedLock);
-            } else {
-                // Check if the file has been opened and set the file
-                // descriptor properly if it has. We will come around again in
-                // the while loop to check this same buffer until its fd has
-                // been set properly.
-                pthread_mutex_lock(&openedLock);
-
-                if (opened) {
-                    // This is the only place the aioBuffer fd structure member
-                    // is modified, so we don't need to lock the aioBuffer.
-                    listHead->fd = fd;
-                }
+            int notify_fd = completionWriteFd;
+            bool notify_eventfd = completionWriteFd == completionReadFd;
+            pthread_mutex_unlock(&completedLock);
+            TRACE(TRACE_COMPLETE, current->offset,
+                  status == -1 ? -1 : (int64_t)wbytes);
+
+            // The writer thread is the reaping context of this backend,
+            // so the completion callback runs here, without any locks
+            // held.
+            if (removal->callback != NULL) {
+                removal->callback(removal->callbackContext, status,
+                                  wbytes < 0 ? 0 : wbytes);
+            }
+
+            // Free the written aioBuffer.
+            freeBuffer(removal);
 
-                pthread_mutex_unlock(&openedLock);
+            // Signal the completion fd now that the write is done and its
+            // queue space is free.
+            signalCompletion(notify_fd, notify_eventfd);
+        } else {
+            // Wait for the open to finish and set the file descriptor of the
+            // buffer. We will come around again in the while loop to write
+            // it. The cancelWrites() method wakes this up as well.
+            pthread_mutex_lock(&openedLock);
+
+            while (!opened && !cancelRequested) {
+                pthread_cond_wait(&openedCond, &openedLock);
             }
 
-            pthread_testcancel();
-            // Lock the mutex again for the while loop evaluation and to
-            // balance the unlock inside the loop.
-            pthread_mutex_lock(&listHeadLock);
+            bool open_failed = opened && fd == -1;
+
+            if (opened) {
+                // This is the only place the aioBuffer fd structure member
+                // is modified, so we don't need to lock the aioBuffer.
+                current->fd = fd;
+            }
+
+            pthread_mutex_unlock(&openedLock);
+
+            // None of the queued writes can be done. They fail instead of
+            // being tried again, which would never wait.
+            if (open_failed) {
+                failQueuedWrites();
+            }
         }
 
-        // Nothing can be done yet because listHead was NULL. We balance the
-        // mutex lock done previously and try again.
-        pthread_mutex_unlock(&listHeadLock);
-        pthread_testcancel();
-        // Sleep for 1 milisecond.
-        usleep(1000);
+        // Lock the mutex again for the while loop evaluation.
+        pthread_mutex_lock(&listHeadLock);
     }
+
+    writerExited = true;
+    pthread_cond_broadcast(&writerCond);
+    pthread_mutex_unlock(&listHeadLock);
 }
 
 int AsyncFileWriter::openFile()
 {
     if (synchronous) {
+        TRACE(TRACE_OPEN_START, 0, 0);
         fd = open(filename, openFlags, openMode);
+        TRACE(TRACE_OPEN_END, 0, fd);
         return fd;
     }
 
@@ -205,11 +712,16 @@ int AsyncFileWriter::openFile()
             return -1;
         }
 
+        if (initThreadAttributes(&attr) != 0) {
+            return -1;
+        }
+
         if (pthread_create(&openTid, &attr, &AsyncFileWriter::thr_open_helper,
                            this) != 0) {
             return -1;
         }
 
+        openStarted = true;
         return 0;
     }
 
@@ -217,9 +729,13 @@ int AsyncFileWriter::openFile()
     return fd;
 }
 
+// Close the file once its writes have completed. Returns -1 without closing
+// it if the buffer of buffered synchronous mode cannot be written out.
 int AsyncFileWriter::closeFile()
 {
     int ret = 0;
+    int close_fd;
+    bool open_failed;
 
     // We should only close the file once. This is used in the destructor, so
     // if the user closed the file explicitly, there is nothing to do.
@@ -227,100 +743,923 @@ int AsyncFileWriter::closeFile()
         return ret;
     }
 
-    if (synchronous) {
-        if (fd != -1) {
-            ret = close(fd);
-        }
-
-        closeCalled = true;
-        return ret;
+    // Buffered synchronous writes go out before the close. If they cannot,
+    // the file stays open with the data still buffered, so the caller can
+    // retry the close.
+    if (flushSyncBuffer() == -1) {
+        return -1;
     }
 
+    closeCalled = true;
     pthread_mutex_lock(&openedLock);
 
-    if (opened) {
-        if (fd == -1) {
-            // There was an open() error.
-            ret = -1;
-        } else {
-            ret = close(fd);
-        }
+    // Wait for an open or file operations still running in the background,
+    // so the fd is not closed under them.
+    while ((openStarted && !opened) || operationsRunning) {
+        pthread_cond_wait(&openedCond, &openedLock);
     }
 
+    close_fd = fd;
+    open_failed = opened && fd == -1;
+    fd = -1;
     pthread_mutex_unlock(&openedLock);
-    closeCalled = true;
-    return ret;
-}
 
-int AsyncFileWriter::getSubmitted()
-{
-    return submitted;
-}
+    // The lock is not held across close(), which can block for a long time
+    // on a network file system.
+    if (open_failed) {
+        // There was an open() error.
+        return -1;
+    }
 
-int AsyncFileWriter::getCompleted()
-{
-    int num_completed;
+    if (close_fd != -1) {
+        // All writes have completed by now, so extending the file to the
+        // current offset only fills in the trailing hole.
+        if (trailingHole && offset > positionalEnd &&
+            ftruncate(close_fd, offset) == -1) {
+            ret = -1;
+        }
 
-    pthread_mutex_lock(&completedLock);
-    num_completed = completed;
-    pthread_mutex_unlock(&completedLock);
+        if (close(close_fd) == -1) {
+            ret = -1;
+        }
+    }
 
-    return num_completed;
+    return ret;
 }
 
-bool AsyncFileWriter::pendingWrites()
+// Flush the file to stable storage with fsync(). Only writes that have
+// completed are covered, so call this once pendingWrites() is false. It waits
+// for an open still running in the background.
+int AsyncFileWriter::syncFile()
 {
-    bool pending;
+    int sync_fd;
 
-    pthread_mutex_lock(&completedLock);
-    pending = submitted != completed;
-    pthread_mutex_unlock(&completedLock);
+    pthread_mutex_lock(&openedLock);
 
-    return pending;
-}
+    while (openStarted && !opened) {
+        pthread_cond_wait(&openedCond, &openedLock);
+    }
 
-bool AsyncFileWriter::getSynchronous()
-{
-    return synchronous;
-}
+    sync_fd = fd;
+    pthread_mutex_unlock(&openedLock);
 
-void AsyncFileWriter::setSynchronous(bool value)
-{
-    synchronous = value;
+    if (sync_fd == -1 || closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    return fsync(sync_fd);
 }
 
-bool AsyncFileWriter::getWriteError()
-{
-    return writeError;
+// This is the private operation thread helper method. This recieves a pointer
+// to this so that it can call the right object's thr_operations() method.
+void *AsyncFileWriter::thr_operations_helper(void *context) {
+    ((AsyncFileWriter *)context)->thr_operations();
+    return (void *)0;
 }
 
-int AsyncFileWriter::submitWrite(const void *data, size_t count)
+// The operation thread. It runs the queued file operations in order once the
+// open has finished and exits when the queue is empty. The lock is only held
+// to take an operation off the queue, never across the system call.
+void AsyncFileWriter::thr_operations()
 {
-    // Do a simple pwrite() if in synchronous mode.
-    if (synchronous) {
-        int wbytes;
+    configureThread();
 
-        if ((wbytes = write(fd, data, count)) != count) {
-            // This could be because of an error (-1 return value) or a short
-            // write. Neither of those should happen, so we just return an
-            // error.
-            return -1;
-        }
+    pthread_mutex_lock(&openedLock);
 
-        return wbytes;
+    while (openStarted && !opened) {
+        pthread_cond_wait(&openedCond, &openedLock);
     }
 
-    // Check if there was an init error. This only happens if the mutex
-    // initialization failed.
-    if (initError) {
-        return -1;
-    }
+    while (operationHead != NULL) {
+        fileOperation *operation = operationHead;
+        int operation_fd = fd;
+        const char *name = filename;
+        int error = 0;
 
-    // Check if there was a write error.
-    pthread_mutex_lock(&writeErrorLock);
+        operationHead = operation->next;
 
-    if (writeError) {
-        pthread_mutex_unlock(&writeErrorLock);
+        if (operationHead == NULL) {
+            operationTail = NULL;
+        }
+
+        if (operation->type == FILE_OPERATION_CLOSE) {
+            fd = -1;
+        }
+
+        pthread_mutex_unlock(&openedLock);
+
+        switch (operation->type) {
+        case FILE_OPERATION_CLOSE:
+            if (operation_fd == -1) {
+                error = EBADF;
+                break;
+            }
+
+            if (operation->length != -1 &&
+                ftruncate(operation_fd, operation->length) == -1) {
+                error = errno;
+            }
+
+            if (close(operation_fd) == -1 && error == 0) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_TRUNCATE:
+            if (operation_fd == -1) {
+                error = EBADF;
+            } else if (ftruncate(operation_fd, operation->length) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_SYNC:
+            if (operation_fd == -1) {
+                error = EBADF;
+            } else if (fsync(operation_fd) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_UNLINK:
+            if (unlink(name) == -1) {
+                error = errno;
+            }
+
+            break;
+        case FILE_OPERATION_RENAME:
+            if (rename(name, operation->newName) == -1) {
+                error = errno;
+            }
+
+            break;
+        }
+
+        if (operation->callback != NULL) {
+            operation->callback(operation->callbackContext, error);
+        }
+
+        pthread_mutex_lock(&openedLock);
+
+        // Later operations use the new name.
+        if (operation->type == FILE_OPERATION_RENAME && error == 0) {
+            filename = operation->newName;
+        }
+
+        free(operation);
+    }
+
+    operationsRunning = false;
+    pthread_cond_broadcast(&openedCond);
+    pthread_mutex_unlock(&openedLock);
+}
+
+// Queue a file operation and start the operation thread if it is not running.
+int AsyncFileWriter::queueOperation(int type, off_t length,
+                                    const char *new_name, fileCallback callback,
+                                    void *context)
+{
+    fileOperation *operation;
+
+    if (initError) {
+        return -1;
+    }
+
+    if ((operation = (fileOperation *)malloc(sizeof(fileOperation))) == NULL) {
+        return -1;
+    }
+
+    operation->type = type;
+    operation->length = length;
+    operation->newName = new_name;
+    operation->callback = callback;
+    operation->callbackContext = context;
+    operation->next = NULL;
+
+    pthread_mutex_lock(&openedLock);
+
+    if (!operationsRunning) {
+        pthread_attr_t operation_attr;
+        pthread_t operation_tid;
+        int ret = -1;
+
+        // The thread is detached like the open thread. The destructor waits
+        // for it through operationsRunning instead of joining it.
+        if (pthread_attr_init(&operation_attr) == 0) {
+            if (pthread_attr_setdetachstate(&operation_attr,
+                                            PTHREAD_CREATE_DETACHED) == 0 &&
+                initThreadAttributes(&operation_attr) == 0) {
+                // The queue is empty while the thread is not running, and the
+                // lock is held, so the new thread waits for the operation.
+                ret = pthread_create(&operation_tid, &operation_attr,
+                                     &AsyncFileWriter::thr_operations_helper,
+                                     this);
+            }
+
+            pthread_attr_destroy(&operation_attr);
+        }
+
+        if (ret != 0) {
+            pthread_mutex_unlock(&openedLock);
+            free(operation);
+            return -1;
+        }
+
+        operationsRunning = true;
+    }
+
+    if (operationTail == NULL) {
+        operationHead = operation;
+    } else {
+        operationTail->next = operation;
+    }
+
+    operationTail = operation;
+    pthread_mutex_unlock(&openedLock);
+    return 0;
+}
+
+// Close the file in the background. Like closeFile(), call this once
+// pendingWrites() is false. The callback runs on the operation thread and
+// receives EBADF if the file is not open. Returns -1 if the file was already
+// closed or the close could not be queued.
+int AsyncFileWriter::closeFileAsync(fileCallback callback, void *context)
+{
+    if (closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    off_t length = trailingHole && offset > positionalEnd ? offset : -1;
+
+    if (queueOperation(FILE_OPERATION_CLOSE, length, NULL, callback,
+                       context) == -1) {
+        return -1;
+    }
+
+    closeCalled = true;
+    return 0;
+}
+
+// Flush the file to stable storage in the background. Only writes that have
+// completed by the time the fsync runs are covered.
+int AsyncFileWriter::syncFileAsync(fileCallback callback, void *context)
+{
+    if (closeCalled) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    return queueOperation(FILE_OPERATION_SYNC, -1, NULL, callback, context);
+}
+
+// Remove the file in the background. The file can still be written and
+// closed afterwards.
+int AsyncFileWriter::unlinkFile(fileCallback callback, void *context)
+{
+    return queueOperation(FILE_OPERATION_UNLINK, -1, NULL, callback, context);
+}
+
+// Rename the file in the background. The writer uses the new name once the
+// rename succeeds, so the string has to stay valid as long as the writer,
+// like the one given to the constructor.
+int AsyncFileWriter::renameFile(const char *new_name, fileCallback callback,
+                                void *context)
+{
+    return queueOperation(FILE_OPERATION_RENAME, -1, new_name, callback,
+                          context);
+}
+
+int64_t AsyncFileWriter::getSubmitted()
+{
+    return submitted;
+}
+
+int64_t AsyncFileWriter::getCompleted()
+{
+    int64_t num_completed;
+
+    pthread_mutex_lock(&completedLock);
+    num_completed = completed;
+    pthread_mutex_unlock(&completedLock);
+
+    return num_completed;
+}
+
+// Return the number of writes, counted in the order they were submitted,
+// that have all completed. Each lane completes in order, so this is the
+// oldest write still queued in either lane. Memory passed to
+// submitWriteNoCopy() can be reused once this count is past the write that
+// used it.
+int64_t AsyncFileWriter::getCompletedPrefix()
+{
+    int64_t prefix = submitted;
+
+    pthread_mutex_lock(&listHeadLock);
+
+    if (listHead != NULL && listHead->sequence < prefix) {
+        prefix = listHead->sequence;
+    }
+
+    if (bulkHead != NULL && bulkHead->sequence < prefix) {
+        prefix = bulkHead->sequence;
+    }
+
+    pthread_mutex_unlock(&listHeadLock);
+    return prefix;
+}
+
+bool AsyncFileWriter::pendingWrites()
+{
+    bool pending;
+
+    pthread_mutex_lock(&completedLock);
+    pending = submitted != completed;
+    pthread_mutex_unlock(&completedLock);
+
+    // Data committed to the staging block is pending too. The next
+    // processQueue() queues it.
+    return pending || stagingUsed > 0;
+}
+
+bool AsyncFileWriter::getSynchronous()
+{
+    return synchronous;
+}
+
+void AsyncFileWriter::setSynchronous(bool value)
+{
+    synchronous = value;
+}
+
+bool AsyncFileWriter::getAdaptiveDispatch()
+{
+    return adaptiveDispatch;
+}
+
+// Choose between a direct pwrite() and the queue for each write, instead of
+// always queueing. A write of up to ADAPTIVE_DISPATCH_MAX_SZ bytes that finds
+// the queue empty is written on the caller's thread while that has had the
+// lower latency, which is when the queue costs more than the syscall. Larger
+// writes and writes behind others are always queued. Direct writes complete
+// before the call returns, like in synchronous mode.
+void AsyncFileWriter::setAdaptiveDispatch(bool value)
+{
+    adaptiveDispatch = value;
+}
+
+// Return true if a write to an empty queue should be written directly. Every
+// ADAPTIVE_DISPATCH_PROBE-th write takes the slower path instead, so its
+// average keeps up with the device and the load.
+bool AsyncFileWriter::dispatchDirect()
+{
+    pthread_mutex_lock(&completedLock);
+    bool direct = directLatency <= queuedLatency;
+    pthread_mutex_unlock(&completedLock);
+
+    if (++dispatchProbe >= ADAPTIVE_DISPATCH_PROBE) {
+        dispatchProbe = 0;
+        return !direct;
+    }
+
+    return direct;
+}
+
+// Write data on the caller's thread for adaptive dispatch and time it. It
+// counts as a submitted and completed write. If it fails, nothing was
+// submitted and -1 is returned, as in synchronous mode. A staging block of
+// staging_size bytes is released once it is written, since no queued write
+// will free it.
+int AsyncFileWriter::writeDirect(int write_fd, const struct iovec *iov,
+                                 int iovcnt, size_t count, bool append,
+                                 off_t write_offset, writeCallback callback,
+                                 void *context, size_t staging_size)
+{
+    double start = monotonicTime();
+    ssize_t wbytes = pwriteData(write_fd, iov, iovcnt, count, write_offset);
+
+    directLatency += (monotonicTime() - start - directLatency) *
+                     ADAPTIVE_DISPATCH_WEIGHT;
+
+    if (wbytes != (ssize_t)count) {
+        return -1;
+    }
+
+    if (staging_size > 0) {
+        releaseStagingBlock(iov[0].iov_base, staging_size);
+    }
+
+    TRACE(TRACE_COMPLETE, write_offset, count);
+    advanceOffset(append, write_offset, count);
+    submitted += 1;
+    pthread_mutex_lock(&completedLock);
+    completed++;
+    pthread_mutex_unlock(&completedLock);
+
+    if (callback != NULL) {
+        callback(context, 0, count);
+    }
+
+    return 0;
+}
+
+size_t AsyncFileWriter::getSyncBufferSize()
+{
+    return syncBufferSize;
+}
+
+// Gather synchronous appends in a buffer of size bytes and write it with one
+// pwrite() when it is full, and on flush(), syncFile() and closeFile(),
+// instead of making a syscall per write. The data is not in the file until
+// then. Writes with a callback, positional writes and writes as large as the
+// buffer go straight to the file after what was buffered. A size of 0 turns
+// the buffer off. Anything still buffered is written first. Returns -1 if
+// that fails or the buffer cannot be allocated.
+int AsyncFileWriter::setSyncBufferSize(size_t size)
+{
+    void *buffer = NULL;
+
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    if (size > 0 && posix_memalign(&buffer, SYNC_BUFFER_ALIGNMENT,
+                                   size) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    free(syncBuffer);
+    syncBuffer = (unsigned char *)buffer;
+    syncBufferSize = size;
+    return 0;
+}
+
+// Write out the buffer of buffered synchronous mode. If that fails, the data
+// is kept for the next try.
+int AsyncFileWriter::flushSyncBuffer()
+{
+    if (syncBufferUsed == 0) {
+        return 0;
+    }
+
+    TRACE(TRACE_SYSCALL_START, syncBufferOffset, syncBufferUsed);
+    ssize_t wbytes = pwriteAll(fd, syncBuffer, syncBufferUsed,
+                               syncBufferOffset);
+    TRACE(TRACE_SYSCALL_END, syncBufferOffset, wbytes);
+
+    if (wbytes != (ssize_t)syncBufferUsed) {
+        return -1;
+    }
+
+    syncBufferUsed = 0;
+    return 0;
+}
+
+BufferArena *AsyncFileWriter::getBufferArena()
+{
+    return bufferArena;
+}
+
+// Copy payloads into blocks from a BufferArena instead of malloc() memory.
+// This has to be set before the first write, and the arena must outlive the
+// writer.
+void AsyncFileWriter::setBufferArena(BufferArena *arena)
+{
+    bufferArena = arena;
+
+    if (bufferArena != NULL && numaNode != -1) {
+        bufferArena->setNumaNode(numaNode);
+    }
+}
+
+bool AsyncFileWriter::getDirectIO()
+{
+#ifdef O_DIRECT
+    return (openFlags & O_DIRECT) != 0;
+#else
+    return false;
+#endif
+}
+
+// Open the file with O_DIRECT where it is available. This has to be set
+// before openFile(). Direct I/O needs aligned buffers, so use it together
+// with a BufferArena, and every write offset and size has to be a multiple
+// of the device block size.
+void AsyncFileWriter::setDirectIO(bool value)
+{
+#ifdef O_DIRECT
+    if (value) {
+        openFlags |= O_DIRECT;
+    } else {
+        openFlags &= ~O_DIRECT;
+    }
+#endif
+}
+
+mode_t AsyncFileWriter::getFileMode()
+{
+    return openMode;
+}
+
+// Set the permissions a file created by openFile() gets, before the umask is
+// applied. This has to be set before openFile(). The default is 0644.
+void AsyncFileWriter::setFileMode(mode_t mode)
+{
+    openMode = mode;
+}
+
+bool AsyncFileWriter::getWriteError()
+{
+    bool error;
+
+    pthread_mutex_lock(&writeErrorLock);
+    error = writeError;
+    pthread_mutex_unlock(&writeErrorLock);
+
+    return error;
+}
+
+int AsyncFileWriter::getWritePriority()
+{
+    return writePriority;
+}
+
+// Set the lane new writes are queued in, WRITE_PRIORITY_NORMAL or
+// WRITE_PRIORITY_BULK. Writes already queued keep their lane.
+int AsyncFileWriter::setWritePriority(int value)
+{
+    if (value != WRITE_PRIORITY_NORMAL && value != WRITE_PRIORITY_BULK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    writePriority = value;
+    return 0;
+}
+
+// Set the I/O priority class and level the writer and open threads run
+// with. This has to be set before openFile(). It is applied when the threads
+// start, and a failure, for example for the realtime class without the
+// privilege for it, leaves them at the default.
+int AsyncFileWriter::setIOPriority(int ioclass, int level)
+{
+    if (ioclass < IO_PRIORITY_REALTIME || ioclass > IO_PRIORITY_IDLE ||
+        level < 0 || level > 7) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ioPriorityClass = ioclass;
+    ioPriorityLevel = level;
+    return 0;
+}
+
+// Set the I/O priority of the calling thread with ioprio_set(2).
+int AsyncFileWriter::setThreadIOPriority(int ioclass, int level)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS with an id of 0 is the calling thread.
+    return syscall(SYS_ioprio_set, 1, 0, (ioclass << 13) | level);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Restrict the writer and open threads to the given CPUs. This has to be
+// set before the threads start. It is only supported on Linux.
+int AsyncFileWriter::setCpuAffinity(const int *cpus, int count)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+
+    for (int c = 0; c < count; c++) {
+        if (cpus[c] < 0 || cpus[c] >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        CPU_SET(cpus[c], &set);
+    }
+
+    cpuAffinity = set;
+    cpuAffinitySet = true;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Set the scheduling policy and priority of the writer and open threads, for
+// example SCHED_FIFO for a writer that has to keep up with a realtime
+// producer. This has to be set before the threads start.
+int AsyncFileWriter::setThreadScheduling(int policy, int priority)
+{
+    if (priority < sched_get_priority_min(policy) ||
+        priority > sched_get_priority_max(policy)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    schedulingPolicy = policy;
+    schedulingPriority = priority;
+    schedulingSet = true;
+    return 0;
+}
+
+int AsyncFileWriter::getNumaNode()
+{
+    return numaNode;
+}
+
+// Place the writer and open threads and the payload buffers on a NUMA
+// node, or with -1, stop placing them. Unless a CPU affinity was set, the
+// threads are restricted to the CPUs of the node, and the buffer arena, if
+// there is one, allocates its memory there. This has to be set before the
+// threads start.
+int AsyncFileWriter::setNumaNode(int node)
+{
+    if (node < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef __linux__
+    // The CPUs of the node are kept apart from the ones setCpuAffinity()
+    // sets, so moving to another node, or to none, replaces only them.
+    cpu_set_t set;
+    int count = 0;
+
+    CPU_ZERO(&set);
+
+    if (node != -1) {
+        // The CPUs of the node are listed as ranges, such as 0-7,16-23.
+        char path[64];
+        FILE *cpulist;
+        int first;
+        int last;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+
+        if ((cpulist = fopen(path, "r")) == NULL) {
+            return -1;
+        }
+
+        while (fscanf(cpulist, "%d", &first) == 1) {
+            last = first;
+
+            if (fscanf(cpulist, "-%d", &last) < 0) {
+                last = first;
+            }
+
+            for (int c = first; c <= last && c < CPU_SETSIZE; c++) {
+                CPU_SET(c, &set);
+                count++;
+            }
+
+            if (fgetc(cpulist) != ',') {
+                break;
+            }
+        }
+
+        fclose(cpulist);
+    }
+
+    numaAffinity = set;
+    numaAffinitySet = count > 0;
+#endif
+
+    numaNode = node;
+
+    if (bufferArena != NULL) {
+        bufferArena->setNumaNode(node);
+    }
+
+    return 0;
+}
+
+int AsyncFileWriter::submitWrite(const void *data, size_t count)
+{
+    return submit(data, count, true, NULL, NULL, -1, 0);
+}
+
+// Queue a write and call callback with context once it completes. The
+// callbacks run on the writer thread right after each write, or from
+// cancelWrites() with a status of -1 if the write is canceled. In synchronous
+// mode the callback runs before this returns.
+int AsyncFileWriter::submitWrite(const void *data, size_t count,
+                                 writeCallback callback, void *context)
+{
+    return submit(data, count, true, callback, context, -1, 0);
+}
+
+// Queue a write without copying the data. The caller must not modify or free
+// the data until getCompletedPrefix() shows the write has completed.
+int AsyncFileWriter::submitWriteNoCopy(const void *data, size_t count)
+{
+    return submit(data, count, false, NULL, NULL, -1, 0);
+}
+
+int AsyncFileWriter::submitWriteNoCopy(const void *data, size_t count,
+                                       writeCallback callback, void *context)
+{
+    return submit(data, count, false, callback, context, -1, 0);
+}
+
+// Queue the buffers of an iovec array as one write, as if they had been
+// concatenated first. They are gathered into a single copy, or written with
+// pwritev() in synchronous mode, and complete together with one callback.
+int AsyncFileWriter::submitWritev(const struct iovec *iov, int iovcnt)
+{
+    return submitWritev(iov, iovcnt, NULL, NULL);
+}
+
+int AsyncFileWriter::submitWritev(const struct iovec *iov, int iovcnt,
+                                  writeCallback callback, void *context)
+{
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return submitv(iov, iovcnt, true, callback, context, -1, 0);
+}
+
+int AsyncFileWriter::write(const void *data, size_t count)
+{
+    return submit(data, count, true, NULL, NULL, -1, 0);
+}
+
+int AsyncFileWriter::write(const void *data, size_t count,
+                           writeCallback callback, void *context)
+{
+    return submit(data, count, true, callback, context, -1, 0);
+}
+
+int AsyncFileWriter::writeNoCopy(const void *data, size_t count)
+{
+    return submit(data, count, false, NULL, NULL, -1, 0);
+}
+
+int AsyncFileWriter::writeNoCopy(const void *data, size_t count,
+                                 writeCallback callback, void *context)
+{
+    return submit(data, count, false, callback, context, -1, 0);
+}
+
+int AsyncFileWriter::writev(const struct iovec *iov, int iovcnt)
+{
+    return writev(iov, iovcnt, NULL, NULL);
+}
+
+int AsyncFileWriter::writev(const struct iovec *iov, int iovcnt,
+                            writeCallback callback, void *context)
+{
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return submitv(iov, iovcnt, true, callback, context, -1, 0);
+}
+
+// Queue a write at offset position instead of after the data written so far,
+// for data that arrives out of order. The append position is not changed.
+// Completion is tracked the same way as for the other writes.
+int AsyncFileWriter::writeAt(off_t position, const void *data, size_t count)
+{
+    return writeAt(position, data, count, NULL, NULL);
+}
+
+int AsyncFileWriter::writeAt(off_t position, const void *data, size_t count,
+                             writeCallback callback, void *context)
+{
+    if (position < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return submit(data, count, true, callback, context, position, 0);
+}
+
+int AsyncFileWriter::submit(const void *data, size_t count, bool copy,
+                            writeCallback callback, void *context,
+                            off_t position, size_t staging_size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = count;
+    return submitv(&iov, 1, copy, callback, context, position, staging_size);
+}
+
+int AsyncFileWriter::submitv(const struct iovec *iov, int iovcnt, bool copy,
+                             writeCallback callback, void *context,
+                             off_t position, size_t staging_size)
+{
+    bool append = position == -1;
+    size_t count = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (count + iov[i].iov_len < count) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        count += iov[i].iov_len;
+    }
+
+    // Data committed to the staging block comes before this write.
+    if (append && staging_size == 0 && stagingUsed > 0 && flush() == -1) {
+        return -1;
+    }
+
+    off_t write_offset = append ? offset : position;
+    TRACE(TRACE_SUBMIT, write_offset, count);
+
+    // Gather appends in the buffer of buffered synchronous mode. They are
+    // complete once they are copied.
+    if (synchronous && append && callback == NULL && count < syncBufferSize) {
+        if (fd == -1) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (syncBufferUsed + count > syncBufferSize &&
+            flushSyncBuffer() == -1) {
+            return -1;
+        }
+
+        if (syncBufferUsed == 0) {
+            syncBufferOffset = write_offset;
+        }
+
+        gather(syncBuffer + syncBufferUsed, iov, iovcnt);
+        syncBufferUsed += count;
+        TRACE(TRACE_COMPLETE, write_offset, count);
+        advanceOffset(append, write_offset, count);
+        return 0;
+    }
+
+    // Any other write goes to the file after the buffered data.
+    if (flushSyncBuffer() == -1) {
+        return -1;
+    }
+
+    // Do a simple pwrite() if in synchronous mode.
+    if (synchronous) {
+        ssize_t wbytes = pwriteData(fd, iov, iovcnt, count, write_offset);
+
+        if (wbytes != (ssize_t)count) {
+            // Short writes are resumed by pwriteAll() and pwritevAll(), so
+            // this is a write error, such as ENOSPC.
+            return -1;
+        }
+
+        TRACE(TRACE_COMPLETE, write_offset, count);
+        advanceOffset(append, write_offset, count);
+
+        if (callback != NULL) {
+            callback(context, 0, count);
+        }
+
+        return 0;
+    }
+
+    // Check if there was an init error. This only happens if the mutex
+    // initialization failed.
+    if (initError) {
+        return -1;
+    }
+
+    // Check if there was a write error no callback reported.
+    pthread_mutex_lock(&writeErrorLock);
+
+    if (refuseWrites) {
+        pthread_mutex_unlock(&writeErrorLock);
         return -1;
     }
 
@@ -338,6 +1677,26 @@ int AsyncFileWriter::submitWrite(const void *data, size_t count)
 
     current_fd = fd;
     pthread_mutex_unlock(&openedLock);
+    double submit_time = 0;
+
+    // In adaptive dispatch, a small write to an empty queue can be written
+    // right away. If it is queued, its latency is measured instead.
+    if (adaptiveDispatch && current_fd != -1 &&
+        count <= ADAPTIVE_DISPATCH_MAX_SZ) {
+        pthread_mutex_lock(&listHeadLock);
+        bool queue_empty = listHead == NULL && bulkHead == NULL;
+        pthread_mutex_unlock(&listHeadLock);
+
+        if (queue_empty && dispatchDirect()) {
+            return writeDirect(current_fd, iov, iovcnt, count, append,
+                               write_offset, callback, context, staging_size);
+        }
+
+        if (queue_empty) {
+            submit_time = monotonicTime();
+        }
+    }
+
     aioBuffer *aio_buffer;
     void *aio_data;
 
@@ -345,60 +1704,299 @@ int AsyncFileWriter::submitWrite(const void *data, size_t count)
         return -1;
     }
 
-    if ((aio_data = malloc(count)) == NULL) {
-        free(aio_buffer);
-        return -1;
+    if (copy) {
+        if (bufferArena != NULL) {
+            aio_data = bufferArena->allocate(count);
+        } else {
+            aio_data = malloc(count);
+        }
+
+        if (aio_data == NULL) {
+            free(aio_buffer);
+            return -1;
+        }
+    } else {
+        aio_data = iov[0].iov_base;
     }
 
     if (pthread_mutex_init(&aio_buffer->aioBufferLock, NULL) != 0) {
+        if (copy) {
+            if (bufferArena != NULL) {
+                bufferArena->release(aio_data, count);
+            } else {
+                free(aio_data);
+            }
+        }
+
         free(aio_buffer);
-        free(aio_data);
         return -1;
     }
 
-    memcpy(aio_data, data, count);
+    if (copy) {
+        gather((unsigned char *)aio_data, iov, iovcnt);
+    }
+
+    aio_buffer->ownsData = copy;
+    aio_buffer->stagingSize = staging_size;
+    aio_buffer->append = append;
+    aio_buffer->callback = callback;
+    aio_buffer->callbackContext = context;
     aio_buffer->fd = current_fd;
     aio_buffer->data = aio_data;
     aio_buffer->count = count;
+    aio_buffer->offset = write_offset;
+    aio_buffer->sequence = submitted;
+    aio_buffer->submitTime = submit_time;
+    aio_buffer->written = 0;
     // Set the next buffer to be NULL.
     aio_buffer->next = NULL;
 
-    // Set the listHead and advance lastBuffer.
+    // Set the head of the lane and advance its last buffer.
+    aioBuffer **head = &listHead;
+    aioBuffer **last = &lastBuffer;
+
+    if (writePriority == WRITE_PRIORITY_BULK) {
+        head = &bulkHead;
+        last = &bulkLastBuffer;
+    }
+
     pthread_mutex_lock(&listHeadLock);
 
-    if (listHead == NULL) {
-        listHead = aio_buffer;
-        lastBuffer = aio_buffer;
+    if (*head == NULL) {
+        *head = aio_buffer;
+        *last = aio_buffer;
     } else {
-        pthread_mutex_lock(&lastBuffer->aioBufferLock);
-        lastBuffer->next = aio_buffer;
-        pthread_mutex_unlock(&lastBuffer->aioBufferLock);
-        lastBuffer = aio_buffer;
+        pthread_mutex_lock(&(*last)->aioBufferLock);
+        (*last)->next = aio_buffer;
+        pthread_mutex_unlock(&(*last)->aioBufferLock);
+        *last = aio_buffer;
     }
 
+    // Wake the writer thread up if it is waiting for a write.
+    pthread_cond_signal(&writerCond);
     pthread_mutex_unlock(&listHeadLock);
     // Increment the offset for the next write and the submitted write count.
+    advanceOffset(append, write_offset, count);
     submitted += 1;
 
-    // The writer will process the aioBuffer list itself because it does
-    // writes in the order they were submitted.
+    // The writer will process the aioBuffer lists itself because it does
+    // the writes of each lane in the order they were submitted.
     if (!writerStarted) {
         // Start the writer thread in a non-detached state so we can kill it
         // later.
-        if (pthread_create(&writerTid, NULL,
+        pthread_attr_t writer_attr;
+
+        if (pthread_attr_init(&writer_attr) != 0) {
+            return -1;
+        }
+
+        if (initThreadAttributes(&writer_attr) != 0 ||
+            pthread_create(&writerTid, &writer_attr,
                            &AsyncFileWriter::thr_writer_helper, this) != 0) {
+            pthread_attr_destroy(&writer_attr);
             return -1;
         }
 
+        pthread_attr_destroy(&writer_attr);
+
         writerStarted = true;
     }
 
     return 0;
 }
 
-int AsyncFileWriter::queueSize()
+// Return a pointer to count bytes of writer owned memory to serialize a
+// record into, instead of building it in a buffer of its own that write()
+// then copies. Records are packed into staging blocks that come from the
+// buffer arena if there is one. Call commit() with the bytes actually used.
+// Reserving again without a commit() returns the same memory. Returns NULL if
+// no memory could be allocated.
+void *AsyncFileWriter::reserve(size_t count)
 {
-    int count;
+    if (stagingBlock != NULL && stagingSize - stagingUsed >= count) {
+        return stagingBlock + stagingUsed;
+    }
+
+    // Queue what was committed to the current block and start a new one.
+    if (flush() == -1) {
+        return NULL;
+    }
+
+    if (stagingBlock != NULL) {
+        releaseStagingBlock(stagingBlock, stagingSize);
+        stagingBlock = NULL;
+    }
+
+    size_t size = count > STAGING_BLOCK_SZ ? count : STAGING_BLOCK_SZ;
+
+    if ((stagingBlock = (unsigned char *)allocateStagingBlock(size)) == NULL) {
+        return NULL;
+    }
+
+    stagingSize = size;
+    stagingUsed = 0;
+    return stagingBlock;
+}
+
+// Commit count bytes of the memory returned by the last reserve(). They are
+// written, in commit order and after the data written so far, when the block
+// is full, or by flush() or processQueue().
+int AsyncFileWriter::commit(size_t count)
+{
+    if (stagingBlock == NULL || stagingSize - stagingUsed < count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stagingUsed += count;
+    return 0;
+}
+
+// Queue the data committed to the staging block. The block itself is written
+// without a copy and comes back for reuse once the write completes.
+int AsyncFileWriter::flush()
+{
+    if (stagingUsed == 0) {
+        return flushSyncBuffer();
+    }
+
+    if (synchronous) {
+        // The data is written or buffered before submit() returns, so the
+        // block can be used again right away.
+        size_t used = stagingUsed;
+
+        stagingUsed = 0;
+
+        if (submit(stagingBlock, used, false, NULL, NULL, -1, 0) == -1) {
+            return -1;
+        }
+
+        return flushSyncBuffer();
+    }
+
+    // The block belongs to the queue from here on.
+    unsigned char *block = stagingBlock;
+    size_t used = stagingUsed;
+    size_t size = stagingSize;
+    int64_t before = submitted;
+
+    stagingBlock = NULL;
+    stagingUsed = 0;
+    stagingSize = 0;
+
+    if (submit(block, used, false, NULL, NULL, -1, size) == -1) {
+        // A write can fail after it was queued, when the queue processing
+        // that follows it fails. The block is only freed here if nothing was
+        // queued.
+        if (submitted == before) {
+            releaseStagingBlock(block, size);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// Move the append position past a write, or only record the end of the
+// file for a positional write.
+void AsyncFileWriter::advanceOffset(bool append, off_t write_offset,
+                                    size_t count)
+{
+    if (append) {
+        offset += count;
+        trailingHole = false;
+    } else if (write_offset + (off_t)count > positionalEnd) {
+        positionalEnd = write_offset + count;
+    }
+}
+
+// Leave a hole of count bytes at the current position instead of writing
+// zeros. Nothing is queued, the next write simply starts further into the
+// file. If the file ends in a hole, closeFile() sets the final length.
+int AsyncFileWriter::writeHole(size_t count)
+{
+    // Data committed to the staging block comes before the hole.
+    if (flush() == -1) {
+        return -1;
+    }
+
+    offset += count;
+
+    if (count > 0) {
+        trailingHole = true;
+    }
+
+    return 0;
+}
+
+// The writer thread completes the writes on its own, so there is nothing to
+// process here besides queueing the staging block. This only reports a write
+// error, the same way the AIO writer does when a write fails.
+int AsyncFileWriter::processQueue()
+{
+    if (getWriteError()) {
+        return -1;
+    }
+
+    return flush();
+}
+
+// Return a file descriptor that becomes readable when writes complete, which
+// is also when queue space frees up. It can be added to an epoll, poll or
+// select loop, which then calls clearCompletionFd() and processQueue() when it
+// is readable. The first call creates it. Returns -1 if it cannot be created.
+int AsyncFileWriter::getCompletionFd()
+{
+    pthread_mutex_lock(&completedLock);
+
+    if (completionReadFd != -1) {
+        pthread_mutex_unlock(&completedLock);
+        return completionReadFd;
+    }
+
+#ifdef __linux__
+    completionReadFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    completionWriteFd = completionReadFd;
+#else
+    int fds[2];
+
+    if (pipe(fds) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+
+        completionReadFd = fds[0];
+        completionWriteFd = fds[1];
+    }
+#endif
+
+    int completion_fd = completionReadFd;
+    pthread_mutex_unlock(&completedLock);
+    return completion_fd;
+}
+
+// Reset the completion fd so it is no longer readable. Call this before
+// processQueue() so no completion is missed.
+void AsyncFileWriter::clearCompletionFd()
+{
+    pthread_mutex_lock(&completedLock);
+    int completion_fd = completionReadFd;
+    pthread_mutex_unlock(&completedLock);
+
+    if (completion_fd == -1) {
+        return;
+    }
+
+    char data[64];
+
+    while (read(completion_fd, data, sizeof(data)) > 0);
+}
+
+int64_t AsyncFileWriter::queueSize()
+{
+    int64_t count;
 
     pthread_mutex_lock(&completedLock);
     count = submitted - completed;
@@ -409,22 +2007,169 @@ int AsyncFileWriter::queueSize()
 
 void AsyncFileWriter::cancelWrites()
 {
-    // Stop the writer thread.
-    pthread_cancel(writerTid);
-    pthread_join(writerTid, NULL);
-    // Free any remaining aioBuffers.
-    aioBuffer *removal;
-    aioBuffer *current = listHead;
+    cancelWrites(0, false);
+}
+
+// Cancel the queued writes. The writer thread is asked to stop and finishes
+// the write in progress first. If it has not stopped after timeout
+// microseconds, 0 being no limit, it is canceled with pthread_cancel() as a
+// last resort, which can only interrupt the write itself. The canceled writes
+// run their callbacks with -1 and the bytes an interrupted write got done.
+// The file is then removed, or with keepCompleted, truncated to the end of
+// the appended data written before the first canceled append. Positional
+// writes never truncate it. Returns -1 with errno set to ETIMEDOUT if the
+// writer thread had to be canceled.
+//
+// A thread in a callback or in I/O that cannot be interrupted does not act on
+// the cancel. If it has not stopped after another timeout, the writes are
+// left queued and -1 is returned with ETIMEDOUT as well. Call this again to
+// finish the cancel once it stops.
+int AsyncFileWriter::cancelWrites(long timeout, bool keep_completed)
+{
+    bool timed_out = false;
+    off_t canceled_from = -1;
+
+    // Stop the writer thread. It only exists once a write was submitted.
+    if (writerStarted) {
+        struct timespec deadline;
+        bool exited;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000000;
+        deadline.tv_nsec += (timeout % 1000000) * 1000;
+
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        // The writer thread may be waiting for a write or for the open, so
+        // wake it up from both.
+        pthread_mutex_lock(&listHeadLock);
+        pthread_mutex_lock(&openedLock);
+        cancelRequested = true;
+        pthread_cond_broadcast(&openedCond);
+        pthread_mutex_unlock(&openedLock);
+        pthread_cond_broadcast(&writerCond);
+
+        while (!writerExited) {
+            if (timeout <= 0) {
+                pthread_cond_wait(&writerCond, &listHeadLock);
+            } else if (pthread_cond_timedwait(&writerCond, &listHeadLock,
+                                              &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        exited = writerExited;
+        pthread_mutex_unlock(&listHeadLock);
+
+        if (!exited) {
+            pthread_cancel(writerTid);
+            timed_out = true;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout / 1000000;
+            deadline.tv_nsec += (timeout % 1000000) * 1000;
+
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            // The cancel unwinds the thread through writerCanceled(), which
+            // marks it exited.
+            pthread_mutex_lock(&listHeadLock);
+
+            while (!writerExited &&
+                   pthread_cond_timedwait(&writerCond, &listHeadLock,
+                                          &deadline) != ETIMEDOUT);
+
+            exited = writerExited;
+            pthread_mutex_unlock(&listHeadLock);
+
+            if (!exited) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        // The thread has stopped or is about to, so this does not block.
+        pthread_join(writerTid, NULL);
+        writerStarted = false;
+        writerExited = false;
+        cancelRequested = false;
+    }
+
+    // Free any remaining aioBuffers in both lanes. None of them was written,
+    // apart from the start of one the last resort cancel interrupted.
+    aioBuffer *lanes[2] = { listHead, bulkHead };
+
+    for (int l = 0; l < 2; l++) {
+        aioBuffer *removal;
+        aioBuffer *current = lanes[l];
+
+        while (current != NULL) {
+            removal = current;
+            current = current->next;
+
+            // Only appends move the end of the data. A positional write below
+            // it must not cut off the appends that were written.
+            off_t written_end = removal->offset + removal->written;
+
+            if (removal->append &&
+                (canceled_from == -1 || written_end < canceled_from)) {
+                canceled_from = written_end;
+            }
+
+            pthread_mutex_lock(&completedLock);
+            completed++;
+            pthread_mutex_unlock(&completedLock);
+
+            if (removal->callback != NULL) {
+                removal->callback(removal->callbackContext, -1,
+                                  removal->written);
+            }
+
+            freeBuffer(removal);
+        }
+    }
+
+    if (listHead != NULL || bulkHead != NULL) {
+        listHead = NULL;
+        lastBuffer = NULL;
+        bulkHead = NULL;
+        bulkLastBuffer = NULL;
+
+        if (keep_completed) {
+            // Cut the file at the first canceled append in the background.
+            // Appending carries on from there. If only positional writes
+            // were canceled, the appended data is complete.
+            if (canceled_from != -1) {
+                if (queueOperation(FILE_OPERATION_TRUNCATE, canceled_from,
+                                   NULL, NULL, NULL) == -1 && fd != -1 &&
+                    ftruncate(fd, canceled_from) == -1) {
+                    // The file keeps the canceled writes' length.
+                }
+
+                offset = canceled_from;
+                trailingHole = false;
 
-    while (current != NULL) {
-        removal = current;
-        pthread_mutex_destroy(&current->aioBufferLock);
-        current = current->next;
-        free(removal);
+                if (positionalEnd > canceled_from) {
+                    positionalEnd = canceled_from;
+                }
+            }
+        } else if (queueOperation(FILE_OPERATION_UNLINK, -1, NULL, NULL,
+                                  NULL) == -1) {
+            // Unlink the file in the background. It is only done here if
+            // that cannot be queued.
+            unlink(filename);
+        }
     }
 
-    if (listHead != NULL) {
-        // Unlink the file.
-        unlink(filename);
+    if (timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
     }
+
+    return 0;
 }
@@ -2,6 +2,7 @@
 #define _ASyncFileWriter_H
 
 #include <cstddef>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -10,39 +11,197 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include "buffer-arena.h"
 #include <thread>
 #include <mutex>
 
+// The name of this writer implementation.
+#define ASYNC_FILE_WRITER_BACKEND   "pthreads"
+
+// The write priorities. Writes in the normal lane are written ahead of bulk
+// writes queued before them, so a large bulk copy does not hold up small,
+// latency sensitive records. Offsets are assigned when a write is submitted,
+// so the order writes are issued in never changes the file layout.
+#define WRITE_PRIORITY_NORMAL       0
+#define WRITE_PRIORITY_BULK         1
+
+// The value the write counts start from. The counters target builds with it
+// just below INT32_MAX, so the counts are checked past 2^31.
+#ifndef WRITE_COUNT_START
+#define WRITE_COUNT_START           0
+#endif
+
+// The I/O scheduling classes for setIOPriority(), as used by ioprio_set(2).
+// The level goes from 0, the highest, to 7 within a class.
+#define IO_PRIORITY_REALTIME        1
+#define IO_PRIORITY_BEST_EFFORT     2
+#define IO_PRIORITY_IDLE            3
+
 using namespace std;
 
+// A write completion callback. It receives the context pointer given with the
+// write, 0 or -1 if the write failed or was canceled, and the number of bytes
+// written.
+typedef void (*writeCallback)(void *, int, size_t);
+
+// A file operation completion callback. It receives the context pointer given
+// with the operation and 0, or the errno value if the operation failed.
+typedef void (*fileCallback)(void *, int);
+
 class AsyncFileWriter {
 private:
+    // A close, fsync, unlink or rename queued by closeFileAsync(),
+    // syncFileAsync(), unlinkFile() or renameFile(), or the truncate of
+    // cancelWrites().
+    typedef struct fileOperation {
+        int             type;
+        // The length of a truncate, the length a close extends the file to
+        // first, or -1.
+        off_t           length;
+        // The new name of a rename.
+        const char      *newName;
+        fileCallback    callback;
+        void            *callbackContext;
+        fileOperation   *next;
+    } fileOperation;
+
     typedef struct aioBuffer {
         pthread_mutex_t aioBufferLock;
         int             fd;
         void            *data;
         size_t          count;
+        off_t           offset;
+        // The number of writes submitted before this one.
+        int64_t         sequence;
+        // This flag indicates the data was copied into memory allocated by
+        // the writer, which frees it when the write completes.
+        bool            ownsData;
+        // The size of the staging block from reserve() the data is in, or 0.
+        // The block goes back to the writer when the write completes.
+        size_t          stagingSize;
+        // This flag indicates the write goes after the data written before
+        // it, rather than to a position given with writeAt().
+        bool            append;
+        // The optional completion callback and its context.
+        writeCallback   callback;
+        void            *callbackContext;
+        // When the write was queued, if it went to an empty queue in adaptive
+        // dispatch and its latency is measured, or 0.
+        double          submitTime;
+        // The bytes written so far. A last resort cancel can stop the write
+        // part way.
+        size_t          written;
         aioBuffer       *next;
     } aioBuffer;
 
+    // The normal lane. The writer thread always empties it before it takes
+    // a buffer from the bulk lane.
     aioBuffer           *listHead;
     aioBuffer           *lastBuffer;
+    // The bulk lane, protected by listHeadLock like the normal lane.
+    aioBuffer           *bulkHead;
+    aioBuffer           *bulkLastBuffer;
+    // The lane new writes are queued in.
+    int                 writePriority;
+    // The I/O priority class and level of the writer and open threads. A
+    // class of 0 leaves them at the process default.
+    int                 ioPriorityClass;
+    int                 ioPriorityLevel;
+    // If cpuAffinitySet is true, the CPUs the writer and open threads may
+    // run on.
+#ifdef __linux__
+    cpu_set_t           cpuAffinity;
+#endif
+    bool                cpuAffinitySet;
+    // The scheduling policy and priority of the writer and open threads, if
+    // schedulingSet is true.
+    int                 schedulingPolicy;
+    int                 schedulingPriority;
+    bool                schedulingSet;
+    // The NUMA node the threads and buffers are placed on, or -1.
+    int                 numaNode;
+    // The CPUs of numaNode, if numaAffinitySet is true. They are used when
+    // no CPU affinity was set.
+#ifdef __linux__
+    cpu_set_t           numaAffinity;
+#endif
+    bool                numaAffinitySet;
     int                 fd;
     const char          *filename;
     int                 openFlags;
+    // Payload buffers come from this arena instead of malloc() if it is set.
+    BufferArena         *bufferArena;
     mode_t              openMode;
-    int                 submitted;
-    int                 completed;
+    // The offset of the next write. Offsets are assigned when a write is
+    // submitted and the writer thread uses pwrite(), so the file layout never
+    // depends on the shared file position.
+    off_t               offset;
+    // This flag indicates the file ends in a hole left by writeHole(). The
+    // closeFile() method extends the file over it.
+    bool                trailingHole;
+    // The end of the furthest write made with writeAt(). A trailing hole
+    // only has to be filled in if the file does not already extend past it.
+    off_t               positionalEnd;
+    // The staging block reserve() hands out, the bytes committed to it and
+    // its size. It is queued as a single write once it is full or flushed.
+    unsigned char       *stagingBlock;
+    size_t              stagingUsed;
+    size_t              stagingSize;
+    // Written staging blocks kept for reuse, linked through their first
+    // bytes. They are returned by the writer thread, so they are protected
+    // by stagingLock.
+    void                *stagingFree;
+    int                 stagingFreeCount;
+    pthread_mutex_t     stagingLock;
+    // The write counts are 64 bits, so a writer handling millions of records
+    // a second can run for months.
+    int64_t             submitted;
+    int64_t             completed;
+    // The completion fd, an eventfd or the read end of a pipe, and the fd
+    // the writer thread writes to signal it. They are -1 until
+    // getCompletionFd() creates them and are protected by completedLock.
+    int                 completionReadFd;
+    int                 completionWriteFd;
+    // Adaptive dispatch. When it is on, a small write to an empty queue is
+    // written on the caller's thread if that has been faster than queueing
+    // one, going by running averages of the latency of both, in seconds.
+    bool                adaptiveDispatch;
+    double              directLatency;
+    double              queuedLatency;
+    int                 dispatchProbe;
     bool                synchronous;
+    // The buffer of buffered synchronous mode, its size, the bytes in it and
+    // the file offset they go to. With a size of 0 every synchronous write
+    // goes straight to pwrite().
+    unsigned char       *syncBuffer;
+    size_t              syncBufferSize;
+    size_t              syncBufferUsed;
+    off_t               syncBufferOffset;
     bool                closeCalled;
     bool                writeError;
+    // Set with writeError when a write with no callback fails. Nothing else
+    // tells the caller that data was lost, so later writes are refused.
+    bool                refuseWrites;
     bool                initError;
 
     // This flag indicates if the file we are working on has been opened.
     // The open() method executes in a separate thread because open() itself
     // can block. We never want to block the caller.
     bool                opened;
+    // This flag indicates the open thread was started. The closeFile() method
+    // waits on openedCond for it to finish so the open can never happen after
+    // the file was closed or the object destroyed.
+    bool                openStarted;
+    // The queued file operations. They run in order on the operation thread,
+    // after the open, without blocking the caller. The thread exits once the
+    // queue is empty. Both are protected by openedLock.
+    fileOperation       *operationHead;
+    fileOperation       *operationTail;
+    bool                operationsRunning;
     pthread_mutex_t     openedLock;
+    pthread_cond_t      openedCond;
     pthread_mutex_t     listHeadLock;
     pthread_mutex_t     writeErrorLock;
     pthread_mutex_t     completedLock;
@@ -53,6 +212,37 @@ private:
     // be protected. The write() calls happen in the writer thread because we
     // never want to block the caller.
     bool                writerStarted;
+    // The writer thread sleeps on writerCond while both lanes are empty.
+    // The cancelWrites() method sets cancelRequested to stop it and waits on
+    // writerCond for writerExited. They are protected by listHeadLock, and
+    // cancelRequested by openedLock as well.
+    pthread_cond_t      writerCond;
+    bool                cancelRequested;
+    bool                writerExited;
+
+    // Queue a write at the given position, or after the data written so far
+    // if it is -1. The data is copied unless copy is false. If the data is a
+    // staging block, the last argument is its size.
+    int submit(const void *, size_t, bool, writeCallback, void *, off_t,
+               size_t);
+    // The same as submit() for the data of an iovec array. Without a copy,
+    // the array must hold a single buffer.
+    int submitv(const struct iovec *, int, bool, writeCallback, void *,
+                off_t, size_t);
+    void advanceOffset(bool, off_t, size_t);
+    int flushSyncBuffer();
+    bool dispatchDirect();
+    int writeDirect(int, const struct iovec *, int, size_t, bool, off_t,
+                    writeCallback, void *, size_t);
+    void *allocateStagingBlock(size_t);
+    void releaseStagingBlock(void *, size_t);
+    void freeBuffer(aioBuffer *);
+    void failQueuedWrites();
+    int queueOperation(int, off_t, const char *, fileCallback, void *);
+    static void *thr_operations_helper(void *);
+    void thr_operations();
+    int initThreadAttributes(pthread_attr_t *);
+    void configureThread();
 
 public:
     AsyncFileWriter(const char *);
@@ -67,20 +257,67 @@ public:
     // so that it can call thr_writer(). You have to use a static method in
     // pthread_create().
     static void *thr_writer_helper(void *);
+    static void writerCanceled(void *);
     // The actual threaded write method called by the private helper.
     void thr_writer();
     int openFile();
     int closeFile();
-    int getSubmitted();
-    int getCompleted();
+    int syncFile();
+    int closeFileAsync(fileCallback, void *);
+    int syncFileAsync(fileCallback, void *);
+    int unlinkFile(fileCallback, void *);
+    int renameFile(const char *, fileCallback, void *);
+    int64_t getSubmitted();
+    int64_t getCompleted();
+    int64_t getCompletedPrefix();
     bool pendingWrites();
     bool getSynchronous();
     void setSynchronous(bool);
+    size_t getSyncBufferSize();
+    int setSyncBufferSize(size_t);
+    bool getAdaptiveDispatch();
+    void setAdaptiveDispatch(bool);
+    BufferArena *getBufferArena();
+    void setBufferArena(BufferArena *);
+    bool getDirectIO();
+    void setDirectIO(bool);
+    mode_t getFileMode();
+    void setFileMode(mode_t);
     bool getWriteError();
+    int getWritePriority();
+    int setWritePriority(int);
+    int setIOPriority(int, int);
+    static int setThreadIOPriority(int, int);
+    int setCpuAffinity(const int *, int);
+    int setThreadScheduling(int, int);
+    int getNumaNode();
+    int setNumaNode(int);
     int submitWrite(const void *, size_t);
+    int submitWrite(const void *, size_t, writeCallback, void *);
+    int submitWriteNoCopy(const void *, size_t);
+    int submitWriteNoCopy(const void *, size_t, writeCallback, void *);
+    int submitWritev(const struct iovec *, int);
+    int submitWritev(const struct iovec *, int, writeCallback, void *);
+    // The same as submitWrite() and submitWriteNoCopy(). These match the AIO
+    // writer so code can be written against either one.
+    int write(const void *, size_t);
+    int write(const void *, size_t, writeCallback, void *);
+    int writeNoCopy(const void *, size_t);
+    int writeNoCopy(const void *, size_t, writeCallback, void *);
+    int writev(const struct iovec *, int);
+    int writev(const struct iovec *, int, writeCallback, void *);
+    int writeAt(off_t, const void *, size_t);
+    int writeAt(off_t, const void *, size_t, writeCallback, void *);
+    int writeHole(size_t);
+    void *reserve(size_t);
+    int commit(size_t);
+    int flush();
     int processQueue();
-    int queueSize();
+    int getCompletionFd();
+    void clearCompletionFd();
+    int64_t queueSize();
     void cancelWrites();
+    int cancelWrites(long, bool);
 };
 
 #endif
@@ -21,7 +21,7 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    int count = (int)strtol(argv[1], (char **)NULL, 10);
+    long long count = strtoll(argv[1], (char **)NULL, 10);
     AsyncFileWriter *asyncFileWriter = new AsyncFileWriter("test-file.txt");
 
     if (asyncFileWriter->openFile() == -1) {
@@ -29,7 +29,7 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    for (int t = 0; t < count; t++) {
+    for (long long t = 0; t < count; t++) {
         if (asyncFileWriter->submitWrite("Hello World\n", 12) == -1) {
             perror("asyncFileWriter.submitWrite() error");
             asyncFileWriter->cancelWrites();